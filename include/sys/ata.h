@@ -0,0 +1,119 @@
+/*************************************************************************//**
+ *****************************************************************************
+ * @file   ata.h
+ * @brief  ATA commands, limits and bus master IDE (BMDMA) registers used
+ *         by hd.c besides those in hd.h.
+ *****************************************************************************
+ *****************************************************************************/
+
+#ifndef	_ORANGES_ATA_H_
+#define	_ORANGES_ATA_H_
+
+#define	ATA_READ_MULTIPLE	0xC4
+#define	ATA_WRITE_MULTIPLE	0xC5
+#define	ATA_SET_MULTIPLE	0xC6
+
+/**
+ * The most sectors moved per DRQ block (i.e. per interrupt) by READ/WRITE
+ * MULTIPLE; the drive may allow fewer, see IDENTIFY word 47.
+ */
+#define	MAX_MULT_SECTS		16
+
+#define	ATA_READ_DMA		0xC8
+#define	ATA_WRITE_DMA		0xCA
+
+/* 48-bit LBA flavors */
+#define	ATA_READ_EXT		0x24
+#define	ATA_READ_DMA_EXT	0x25
+#define	ATA_READ_MULTIPLE_EXT	0x29
+#define	ATA_WRITE_EXT		0x34
+#define	ATA_WRITE_DMA_EXT	0x35
+#define	ATA_WRITE_MULTIPLE_EXT	0x39
+
+#define	LBA28_SECTS		0x10000000	/* sectors reachable by LBA28 */
+#define	LBA28_MAX_COUNT		256
+#define	LBA48_MAX_COUNT		65536
+
+/**
+ * The high order bytes of a 48-bit command, written to the Command Block
+ * Registers before the ones in struct hd_cmd.
+ */
+struct hd_cmd_hob {
+	u8	count;		/* sector count 15:8 */
+	u8	lba_low;	/* LBA 31:24 */
+	u8	lba_mid;	/* LBA 39:32 */
+	u8	lba_high;	/* LBA 47:40 */
+};
+
+/* PCI configuration space, mechanism #1 */
+#define	PCI_CONFIG_ADDR		0xCF8
+#define	PCI_CONFIG_DATA		0xCFC
+#define	PCI_ADDR(bus, dev, func, reg)	(0x80000000 | ((bus) << 16) | \
+					 ((dev) << 11) | ((func) << 8) | \
+					 ((reg) & 0xFC))
+#define	PCI_ID			0x00	/* device << 16 | vendor */
+#define	PCI_COMMAND		0x04
+#define	PCI_CLASS		0x08	/* class, subclass, prog if, rev */
+#define	PCI_BAR4		0x20
+#define	PCI_CMD_IO		0x0001
+#define	PCI_CMD_MASTER		0x0004
+#define	PCI_CLASS_IDE		0x0101	/* mass storage, IDE */
+#define	PCI_IDE_BUSMASTER	0x80	/* prog if: BMDMA capable */
+
+/* Bus master IDE registers of the primary channel, offsets from BAR4 */
+#define	BM_CMD			0
+#define	BM_STATUS		2
+#define	BM_PRDT			4
+#define	BM_CMD_START		0x01
+#define	BM_CMD_READ		0x08	/* the device writes memory */
+#define	BM_ST_ACTIVE		0x01
+#define	BM_ST_ERR		0x02
+#define	BM_ST_INT		0x04
+
+/**
+ * Physical Region Descriptor. A region must not cross a 64K boundary; a
+ * count of 0 means 64K. The largest run, LBA48_MAX_COUNT sectors in up to
+ * NR_MERGE buffers, needs a region per 64K and one more per buffer.
+ */
+struct prd {
+	u32	base;
+	u16	count;
+	u16	flags;
+};
+#define	PRD_EOT			0x8000	/* the last one */
+#define	NR_PRDS			(LBA48_MAX_COUNT * SECTOR_SIZE / 0x10000 + \
+				 NR_MERGE)
+
+/**
+ * A DEV_READ/DEV_WRITE waiting in TASK_HD's queue, which is kept sorted by
+ * sector nr. Requests for adjacent sectors in the same direction are done
+ * by one command, up to NR_MERGE of them. One larger than a command can
+ * move is done by several: sect_nr, nr_sects, la and bytes tell what is
+ * left of it.
+ */
+struct hd_req {
+	MESSAGE		msg;		/**< the request, and the reply */
+	int		src;		/**< whom to reply to */
+	int		drive;
+	int		read;
+	u64		sect_nr;	/**< the first sector, on the drive */
+	int		nr_sects;
+	void *		la;		/**< the caller's buffer */
+	int		bytes;
+	int		xfer;		/**< bytes moved by the command */
+	struct hd_req *	next;
+};
+#define	NR_HD_REQS		(NR_TASKS + NR_PROCS)	/* one per proc */
+#define	NR_MERGE		8
+
+/* what TASK_HD is waiting for the drive to do */
+#define	HD_IDLE			0
+#define	HD_DMA			1	/* a DMA transfer */
+#define	HD_PIO			2	/* the next DRQ block */
+
+#define	out_dword(port, val)	__asm__ __volatile__("outl %0, %w1" : : \
+					"a"((u32)(val)), "Nd"((u16)(port)))
+#define	in_dword(port, val)	__asm__ __volatile__("inl %w1, %0" : \
+					"=a"(val) : "Nd"((u16)(port)))
+
+#endif /* _ORANGES_ATA_H_ */
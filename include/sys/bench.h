@@ -0,0 +1,26 @@
+/*************************************************************************//**
+ *****************************************************************************
+ * @file   bench.h
+ * @brief  Microbenchmark build.
+ *****************************************************************************
+ *****************************************************************************/
+
+#ifndef	_ORANGES_BENCH_H_
+#define	_ORANGES_BENCH_H_
+
+/**
+ * Define it to build a kernel whose user procs are the microbenchmarks of
+ * kernel/bench.c instead of TestA/B/C. It boots, prints cycles per
+ * operation with printl() and then leaves the CPU to IDLE_PROC.
+ */
+/* #define	MICROBENCH */
+
+/* how many times each operation is done */
+#define	BENCH_ITERS		10000
+
+/* kernel/bench.c */
+PUBLIC void	bench_main();
+PUBLIC void	bench_pong();
+PUBLIC void	bench_yield();
+
+#endif /* _ORANGES_BENCH_H_ */
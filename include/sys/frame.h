@@ -0,0 +1,55 @@
+/*************************************************************************//**
+ *****************************************************************************
+ * @file   frame.h
+ * @brief  Drawing a whole screen at once.
+ *****************************************************************************
+ *****************************************************************************/
+
+#ifndef	_ORANGES_FRAME_H_
+#define	_ORANGES_FRAME_H_
+
+/**
+ * Frame requests of TASK_TTY. A proc writes {MAG_CH_FRAME, TIOCTL_XXX} to
+ * its tty, as a write of its own, so the request goes where its printf()s
+ * go (@see tty_frame()).
+ *
+ * What the proc writes to the tty between FRAME_BEGIN and FRAME_END is
+ * drawn on a blank back buffer, from the top left corner of the screen,
+ * without scrolling. At FRAME_END only the cells which differ from the
+ * previous frame are written to the video memory. FRAME_CLEAR is an empty
+ * frame, begun and ended at once.
+ *
+ * Output of anyone else (echo, printl(), panic()) is not held back: it
+ * goes to the screen as usual, and the next frame is drawn in full. A
+ * frame left open for FRAME_TIMEOUT ticks, e.g. by a proc which has been
+ * killed, is ended by the next write of anyone else.
+ */
+#define	MAG_CH_FRAME		'\004'
+
+#define	TIOCTL_FRAME_BEGIN	1
+#define	TIOCTL_FRAME_END	2
+#define	TIOCTL_FRAME_CLEAR	3
+
+#define	FRAME_TIMEOUT		(2 * HZ)
+
+struct frame {
+	int	on;		/**< between FRAME_BEGIN and FRAME_END */
+	int	owner;		/**< proc nr of who sent FRAME_BEGIN */
+	int	since;		/**< ticks at FRAME_BEGIN */
+	int	cursor;		/**< in back[] */
+	int	front_valid;	/**< front[] is what the video memory holds */
+	u16	back[SCR_SIZE];	/**< the frame being drawn */
+	u16	front[SCR_SIZE];/**< the last frame drawn */
+};
+
+/* kernel/console.c */
+PUBLIC void	console_write(CONSOLE* con, const char* buf, int len);
+PUBLIC void	frame_begin(CONSOLE* con, int owner);
+PUBLIC int	in_frame(CONSOLE* con, int src);
+PUBLIC void	frame_write(CONSOLE* con, const char* buf, int len);
+PUBLIC void	frame_end(CONSOLE* con);
+
+/* kernel/main.c */
+PUBLIC void	tty_frame(int request);
+
+#endif /* _ORANGES_FRAME_H_ */
@@ -0,0 +1,65 @@
+/*************************************************************************//**
+ *****************************************************************************
+ * @file   grant.h
+ * @brief  Memory grants: letting another proc access a region of yours.
+ *****************************************************************************
+ *****************************************************************************/
+
+#ifndef	_ORANGES_GRANT_H_
+#define	_ORANGES_GRANT_H_
+
+/**
+ * A proc registers (base, length, rights) and passes the returned grant id
+ * in a MESSAGE instead of a raw (PROC_NR, BUF) pair. The receiver can only
+ * reach the region through grant_la() / safecopy_from() / safecopy_to(),
+ * which check the id, the grantee, the rights and the bounds.
+ */
+#define	NR_GRANTS		32
+
+/* rights, from the grantee's point of view */
+#define	GRANT_READ		0x1	/**< grantee may read the region */
+#define	GRANT_WRITE		0x2	/**< grantee may write the region */
+
+#define	GRANT_INVALID		-1
+
+/**
+ * Bits 0~7 of a grant id are the slot, the rest is the generation of the
+ * slot, so an id which has been revoked is never taken for a new grant.
+ */
+#define	GRANT_ID(slot, gen)	((((gen) & 0x7FFFFF) << 8) | (slot))
+#define	GRANT_SLOT(id)		((id) & 0xFF)
+
+/* MESSAGE types, kept clear of `enum msgtype' in const.h */
+#define	DEV_READ_S		1101	/**< DEV_READ into a grant */
+#define	DEV_WRITE_S		1102	/**< DEV_WRITE from a grant */
+#define	GRANT_CREATE		2101	/**< ask TASK_SYS for a grant */
+#define	GRANT_REVOKE		2102	/**< ask TASK_SYS to revoke a grant */
+
+/* MESSAGE field of a grant id */
+#define	GRANT			u.m3.m3i1
+
+struct grant {
+	int	owner;		/**< proc nr of the owner */
+	int	grantee;	/**< who may use it, ANY for anyone */
+	u32	base;		/**< linear address of the region */
+	int	len;		/**< in bytes */
+	int	rights;		/**< 0 if the slot is free */
+	int	gen;
+};
+
+/* kernel/proc.c */
+PUBLIC int	grant_alloc(int owner, int grantee, void* la, int len,
+			    int rights);
+PUBLIC int	grant_free(int owner, int id);
+PUBLIC void*	grant_la(int grantee, int id, int offset, int len,
+			 int rights);
+PUBLIC int	safecopy_from(int grantee, int id, int offset, void* dst,
+			      int len);
+PUBLIC int	safecopy_to(int grantee, int id, int offset, void* src,
+			    int len);
+
+/* kernel/main.c */
+PUBLIC int	make_grant(int grantee, void* base, int len, int rights);
+PUBLIC int	revoke_grant(int id);
+
+#endif /* _ORANGES_GRANT_H_ */
@@ -0,0 +1,57 @@
+/*************************************************************************//**
+ *****************************************************************************
+ * @file   ipc.h
+ * @brief  Non-blocking IPC: async send and notify.
+ *****************************************************************************
+ *****************************************************************************/
+
+#ifndef	_ORANGES_IPC_H_
+#define	_ORANGES_IPC_H_
+
+/**
+ * Functions of `sendrec' besides SEND, RECEIVE and BOTH (see const.h).
+ *
+ *   - SENDA  : copy the MESSAGE into the mailbox of dest and return at once.
+ *   - NOTIFY : set a pending bit in dest and return at once. Pending bits
+ *              coalesce, so dest gets one NOTIFY_MSG per notifier however
+ *              many times it was notified.
+ */
+#define	SENDA			4
+#define	NOTIFY			5
+
+/**
+ * Type of the MESSAGE a proc receives for a pending notification. Its
+ * `source' is the notifier. Kept clear of `enum msgtype' in const.h.
+ */
+#define	NOTIFY_MSG		2001
+
+/* How many async MESSAGEs a proc's mailbox can hold */
+#define	NR_MAILBOX_MSGS		8
+
+/* u32 words needed for one pending-notification bit per proc */
+#define	NR_NOTIFY_WORDS		((NR_TASKS + NR_PROCS + 31) / 32)
+
+/* Return values of sendrec() other than 0 */
+#define	E_MAILBOX_FULL		1
+#define	E_DEADLOCK		2
+
+/**
+ * Comment it out to build a kernel which does not look for wait-for cycles
+ * when a SEND is about to block.
+ */
+#define	DEADLOCK_CHECK
+
+/**
+ * A bounded ring of MESSAGEs sent to a proc by SENDA and not received yet.
+ */
+struct mailbox {
+	MESSAGE	msg[NR_MAILBOX_MSGS];
+	int	head;	/**< the oldest MESSAGE */
+	int	count;
+};
+
+/* kernel/proc.c */
+PUBLIC int	has_senders(int dest);
+PUBLIC int	awaits_from(int pid, int src);
+
+#endif /* _ORANGES_IPC_H_ */
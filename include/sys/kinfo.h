@@ -0,0 +1,36 @@
+/*************************************************************************//**
+ *****************************************************************************
+ * @file   kinfo.h
+ * @brief  Kernel info page: counters any proc can read without IPC.
+ *****************************************************************************
+ *****************************************************************************/
+
+#ifndef	_ORANGES_KINFO_H_
+#define	_ORANGES_KINFO_H_
+
+/**
+ * Only the kernel (Ring 0) writes it; tasks and user procs just read it.
+ * It sits alone in a page of its own so that the page can be mapped
+ * read-only for Ring 1~3.
+ */
+struct kinfo {
+	volatile int	ticks;	/**< same as the global `ticks' */
+	int		hz;	/**< clock interrupts per second */
+	volatile int	idle_ticks; /**< ticks spent in the idle proc */
+
+	/* TSC, calibrated against the PIT by init_clock() */
+	u32		tsc_khz;	/**< TSC cycles per millisecond */
+	u32		ns_mult;	/**< ns = cycles * ns_mult >> ns_shift */
+	int		ns_shift;
+
+	/* cost of syscall traps, from after `save' to `restart' */
+	volatile u32	nr_traps;
+	volatile u64	trap_cycles;	/**< all traps together */
+	volatile u32	trap_min;	/**< in cycles */
+	volatile u32	trap_max;	/**< in cycles */
+};
+
+/* kernel/clock.c */
+extern struct kinfo	kinfo;
+
+#endif /* _ORANGES_KINFO_H_ */
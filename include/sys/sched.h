@@ -0,0 +1,107 @@
+/*************************************************************************//**
+ *****************************************************************************
+ * @file   sched.h
+ * @brief  Ready queues of the scheduler.
+ *****************************************************************************
+ *****************************************************************************/
+
+#ifndef	_ORANGES_SCHED_H_
+#define	_ORANGES_SCHED_H_
+
+/**
+ * One FIFO ready queue per priority value. A proc whose priority is greater
+ * than NR_SCHED_QUEUES - 1 goes into the last queue.
+ */
+#define	NR_SCHED_QUEUES		32
+
+/**
+ * Multilevel feedback queue. `priority' only tells the class of a proc
+ * (PRIO_TASK or PRIO_USER, set in kernel_main()) and is never changed by
+ * the scheduler. Within its class a proc sits on one of
+ * NR_MLFQ_LEVELS levels, the queue being
+ *
+ *	priority + (NR_MLFQ_LEVELS - 1) - level
+ *
+ * A proc starts on level 0. Using up the quantum of its level moves it one
+ * level down; blocking in msg_receive() moves it one level up; every
+ * MLFQ_BOOST_TICKS all procs go back to level 0.
+ */
+#define	NR_MLFQ_LEVELS		4
+#define	MLFQ_BOOST_TICKS	HZ
+
+/* the classes; a proc woken above the running one preempts it */
+#define	PRIO_TASK		15
+#define	PRIO_USER		5
+
+/**
+ * The ready queues. Bit n of `bitmap' is set iff queue n is not empty,
+ * so the highest non-empty queue can be found with a single `bsr'.
+ */
+struct run_queue {
+	u32		bitmap;
+	struct proc *	head[NR_SCHED_QUEUES];
+	struct proc *	tail[NR_SCHED_QUEUES];
+};
+
+/**
+ * Links of a proc in a run_queue. They would live in `struct proc' but are
+ * kept aside (indexed by proc nr) so that the scheduler owns them.
+ */
+struct rq_link {
+	struct proc *		prev;
+	struct proc *		next;
+	struct run_queue *	rq;	/**< 0 if the proc is not queued */
+	int			q;	/**< index of the queue in rq */
+};
+
+/**
+ * Time-slice donation. When a proc blocks waiting for a partner who is
+ * runnable, it switches straight to the partner and lends it the rest of
+ * its slice. The lent ticks are used up first; whatever is left goes back
+ * to the lender when the partner replies to it.
+ */
+struct donation {
+	struct proc *	from;	/**< the lender, 0 if none */
+	int		ticks;	/**< how many ticks were lent */
+	int		base;	/**< borrower's ticks right after lending */
+};
+
+/**
+ * The idle proc. It lives in the slot right after LAST_PROC, so loops over
+ * FIRST_PROC~LAST_PROC never see it, and it is never put into a run_queue:
+ * schedule() falls back to it when no other proc is runnable.
+ */
+#define	IDLE_PROC		(NR_TASKS + NR_PROCS)
+#define	STACK_SIZE_IDLE		0x400
+
+/**
+ * `sendrec' function used by the idle proc only: halt the CPU in Ring 0
+ * until the next interrupt. See sys_sendrec().
+ */
+#define	IDLE			6
+
+/**
+ * `sendrec' function: go to the tail of the caller's ready queue and let
+ * the others at the same level run first. See yield().
+ */
+#define	YIELD			7
+
+/* kernel/global.c */
+extern struct task	idle_task;
+extern char		idle_stack[];
+
+/* kernel/proc.c */
+PUBLIC void	init_sched();
+PUBLIC void	sched_clock(int nr_ticks);
+PUBLIC void	sched_charge(struct proc* p, int nr_ticks);
+PUBLIC void	idle();
+PUBLIC void	yield();
+
+/**
+ * Define it to build the `sched' shell command and a TestC which counts
+ * its loops, to see how the scheduler trades wake-up latency of an
+ * interactive proc against throughput of a CPU-bound one.
+ */
+/* #define	SCHED_BENCH */
+
+#endif /* _ORANGES_SCHED_H_ */
@@ -0,0 +1,78 @@
+/*************************************************************************//**
+ *****************************************************************************
+ * @file   serial.h
+ * @brief  Serial console on COM1 (16550 UART).
+ *****************************************************************************
+ *****************************************************************************/
+
+#ifndef	_ORANGES_SERIAL_H_
+#define	_ORANGES_SERIAL_H_
+
+/**
+ * Comment it out to leave COM1 alone. Everything in serial.c then does
+ * nothing, as if no UART were found.
+ */
+#define	SERIAL_CONSOLE
+
+/* 16550 registers, offsets from COM1_BASE */
+#define	COM1_BASE		0x3F8
+#define	UART_RBR		0	/* receive buffer	(DLAB = 0, R) */
+#define	UART_THR		0	/* transmit holding	(DLAB = 0, W) */
+#define	UART_DLL		0	/* divisor latch low	(DLAB = 1)    */
+#define	UART_IER		1	/* interrupt enable	(DLAB = 0)    */
+#define	UART_DLM		1	/* divisor latch high	(DLAB = 1)    */
+#define	UART_IIR		2	/* interrupt ident	(R)           */
+#define	UART_FCR		2	/* FIFO control		(W)           */
+#define	UART_LCR		3	/* line control */
+#define	UART_MCR		4	/* modem control */
+#define	UART_LSR		5	/* line status */
+#define	UART_SCR		7	/* scratch */
+
+#define	IER_RDA			0x01	/* received data available */
+#define	IER_THRE		0x02	/* transmit holding register empty */
+#define	FCR_ENABLE		0xC7	/* enable & clear, 14-byte trigger */
+#define	LCR_8N1			0x03
+#define	LCR_DLAB		0x80
+#define	MCR_DTR_RTS_OUT2	0x0B	/* OUT2 gates the IRQ line */
+#define	LSR_DR			0x01	/* data ready */
+#define	LSR_THRE		0x20
+
+#define	UART_FIFO_SIZE		16
+#define	UART_CLOCK		115200	/* 1.8432 MHz / 16 */
+#define	SERIAL_BAUD		115200
+
+/* both must be powers of 2 */
+#define	SERIAL_TX_BYTES		1024
+#define	SERIAL_RX_BYTES		64
+
+/**
+ * COM1 gets everything printx() prints, and also whatever is written to
+ * (and typed on) the TTY whose nr is `serial_tty'. SERIAL_TTY is the
+ * one at boot; SERIAL_NONE leaves only printx() on COM1.
+ */
+#define	SERIAL_TTY		0
+#define	SERIAL_NONE		-1
+
+/**
+ * MESSAGE type to TASK_TTY: mirror the TTY msg.DEVICE on COM1 from now
+ * on (SERIAL_NONE: none). Kept clear of `enum msgtype' in const.h.
+ */
+#define	SERIAL_SELECT		2501
+
+struct serial_ring {
+	u8	buf[SERIAL_TX_BYTES];
+	u32	head;	/**< where the next byte goes, never wraps */
+	u32	tail;	/**< the oldest byte, never wraps */
+};
+
+extern	int	serial_tty;
+
+/* kernel/serial.c */
+PUBLIC void	init_serial();
+PUBLIC void	serial_handler(int irq);
+PUBLIC void	serial_putc(char ch);
+PUBLIC void	serial_write(const char* buf, int len);
+PUBLIC int	serial_getc();
+PUBLIC void	serial_poll_puts(const char* s);
+
+#endif /* _ORANGES_SERIAL_H_ */
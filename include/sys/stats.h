@@ -0,0 +1,38 @@
+/*************************************************************************//**
+ *****************************************************************************
+ * @file   stats.h
+ * @brief  Per-proc CPU and IPC accounting.
+ *****************************************************************************
+ *****************************************************************************/
+
+#ifndef	_ORANGES_STATS_H_
+#define	_ORANGES_STATS_H_
+
+/**
+ * MESSAGE type asking TASK_SYS for a copy of proc_stats[PROC_NR], which is
+ * put at BUF. Kept clear of `enum msgtype' in const.h.
+ */
+#define	GET_PROC_STATS		2301
+
+/**
+ * Kept by the kernel for every proc, IDLE_PROC included. Times are in
+ * clock ticks.
+ */
+struct proc_stats {
+	int	utime;		/**< ticks which hit the proc's own code */
+	int	stime;		/**< ticks which hit the kernel working for it */
+	int	nvcsw;		/**< voluntary switches: it blocked */
+	int	nivcsw;		/**< involuntary switches: it was preempted */
+	int	nr_sent;	/**< MESSAGEs sent (SEND, SENDA, NOTIFY) */
+	int	nr_received;	/**< MESSAGEs received, HARD_INT included */
+	int	sending_ticks;	/**< time blocked in SENDING */
+	int	receiving_ticks;/**< time blocked in RECEIVING */
+};
+
+/* kernel/proc.c */
+extern struct proc_stats	proc_stats[];
+
+/* kernel/main.c */
+PUBLIC int	get_proc_stats(int proc_nr, struct proc_stats* st);
+
+#endif /* _ORANGES_STATS_H_ */
@@ -0,0 +1,59 @@
+/*************************************************************************//**
+ *****************************************************************************
+ * @file   timer.h
+ * @brief  Timer wheel for sleeping procs.
+ *****************************************************************************
+ *****************************************************************************/
+
+#ifndef	_ORANGES_TIMER_H_
+#define	_ORANGES_TIMER_H_
+
+/**
+ * A hashed timer wheel: a timer which expires at tick t hangs on slot
+ * (t % NR_TIMER_SLOTS), so each clock interrupt only looks at one slot.
+ * Timers more than NR_TIMER_SLOTS ticks away stay on their slot for more
+ * than one round. Must be a power of 2.
+ */
+#define	NR_TIMER_SLOTS		64
+
+/**
+ * MESSAGE type of a sleep request to TASK_SYS, kept clear of `enum msgtype'
+ * in const.h. CNT is how many ticks to sleep. The reply (SYSCALL_RET) comes
+ * when they are over.
+ */
+#define	SLEEP			2201
+
+/**
+ * Comment it out to build a kernel whose clock always interrupts HZ times a
+ * second. With it, the PIT is programmed one-shot for the next timer or the
+ * end of the current time slice, whichever comes first, and falls back to
+ * periodic mode when the next interrupt is one tick away anyway.
+ */
+#define	TICKLESS
+
+/* 8253 mode 0 (interrupt on terminal count), LSB then MSB, counter 0 */
+#define	ONE_SHOT		0x30
+
+/* How many ticks one shot can span: the counter is only 16 bits wide */
+#define	MAX_LAPSE		(0xFFFF / (TIMER_FREQ / HZ))
+
+/* PIT counts in a tick */
+#define	TICK_UNITS		(TIMER_FREQ / HZ)
+
+/* 8253 command: latch counter 0, so that it can be read */
+#define	LATCH_COUNTER0		0x00
+
+/* One timer per proc, since a proc can only sleep once at a time */
+struct timer {
+	struct timer *	prev;
+	struct timer *	next;
+	u32		expire;	/**< when, counted by the wheel */
+	int		armed;
+};
+
+/* kernel/clock.c */
+PUBLIC void	set_timer(int proc_nr, int nr_ticks);
+PUBLIC int	next_expired();
+PUBLIC void	clock_resync();
+
+#endif /* _ORANGES_TIMER_H_ */
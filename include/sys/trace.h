@@ -0,0 +1,70 @@
+/*************************************************************************//**
+ *****************************************************************************
+ * @file   trace.h
+ * @brief  Kernel trace ring.
+ *****************************************************************************
+ *****************************************************************************/
+
+#ifndef	_ORANGES_TRACE_H_
+#define	_ORANGES_TRACE_H_
+
+/**
+ * Comment it out to build a kernel without tracing: TRACE_EVENT() then
+ * compiles to nothing.
+ */
+#define	TRACE
+
+/* How many records the ring holds. Must be a power of 2. */
+#define	NR_TRACE_RECS		1024
+
+/* Record types, and what a, b and c mean for each */
+#define	TR_SCHED		1	/* prev proc, next proc */
+#define	TR_SEND			2	/* src, dest, MESSAGE type */
+#define	TR_RECV			3	/* receiver, src, MESSAGE type */
+#define	TR_INFORM_INT		4	/* task */
+#define	TR_IRQ_ENTER		5	/* irq */
+#define	TR_IRQ_EXIT		6	/* irq */
+#define	TR_HD_CMD		7	/* ATA command, LBA, sector count */
+#define	TR_HD_DONE		8	/* status register */
+
+/**
+ * One record. `seq' is written last, as (index in the ring + 1), so a
+ * reader can tell a complete record from one being written or one which
+ * has been overwritten.
+ */
+struct trace_rec {
+	u32	seq;
+	u32	tsc_lo;
+	u32	tsc_hi;
+	int	ticks;
+	int	type;
+	int	a;
+	int	b;
+	int	c;
+};
+
+/**
+ * Written by the kernel and drivers (Ring 0~1), read by anyone. `head'
+ * counts all records ever written; slots are taken with `lock xadd', so
+ * an interrupt handler can trace in the middle of another record without
+ * any lock.
+ */
+struct trace_ring {
+	volatile u32		head;
+	volatile int		on;	/**< readers turn it off to drain */
+	struct trace_rec	rec[NR_TRACE_RECS];
+};
+
+#ifdef TRACE
+#define	TRACE_EVENT(type, a, b, c)	trace_emit(type, a, b, c)
+#else
+#define	TRACE_EVENT(type, a, b, c)
+#endif
+
+/* kernel/trace.c */
+extern struct trace_ring	trace_ring;
+PUBLIC void	trace_emit(int type, int a, int b, int c);
+PUBLIC void	trace_irq_enter(int irq);
+PUBLIC void	trace_irq_exit(int irq);
+
+#endif /* _ORANGES_TRACE_H_ */
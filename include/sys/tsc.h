@@ -0,0 +1,42 @@
+/*************************************************************************//**
+ *****************************************************************************
+ * @file   tsc.h
+ * @brief  Time Stamp Counter: high-resolution time.
+ *****************************************************************************
+ *****************************************************************************/
+
+#ifndef	_ORANGES_TSC_H_
+#define	_ORANGES_TSC_H_
+
+/* 8253 counter 2 and the 8255 port which gates it, for calibration */
+#define	TIMER2			0x42
+#define	PPI_B			0x61
+#define	TIMER2_GATE		0x01
+#define	SPEAKER_ON		0x02
+#define	TIMER2_OUT		0x20
+#define	CALIBRATE_MS		10	/* how long to count TSC cycles */
+
+/* Read the TSC: lo and hi get bits 0~31 and 32~63 */
+#define	rdtsc(lo, hi)	__asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi))
+
+/**
+ * (hi:lo) / d, with remainder. The quotient must fit in 32 bits, so there
+ * is no need for the 64-bit division of libgcc.
+ */
+#define	div64_32(hi, lo, d, q, r)				\
+	__asm__("divl %4" : "=a"(q), "=d"(r) : "a"(lo), "d"(hi), "rm"(d))
+
+struct ktimespec {
+	u32	tv_sec;
+	u32	tv_nsec;
+};
+
+/* kernel/clock.c */
+PUBLIC u64	tsc2ns(u32 lo, u32 hi);
+PUBLIC void	trap_enter();
+PUBLIC void	trap_exit();
+
+/* kernel/main.c */
+PUBLIC void	clock_gettime(struct ktimespec* ts);
+
+#endif /* _ORANGES_TSC_H_ */
@@ -0,0 +1,182 @@
+/*************************************************************************//**
+ *****************************************************************************
+ * @file   bench.c
+ * @brief  Microbenchmarks of IPC, syscalls and context switches.
+ *
+ * Built into the kernel only with MICROBENCH (see bench.h), in which case
+ * user_proc_table (global.c) runs these three procs instead of TestA/B/C:
+ *   - bench_main  : drives the benchmarks and prints the results
+ *   - bench_pong  : the other end of the ping-pong
+ *   - bench_yield : the other proc of the yield storm
+ * Every figure is TSC cycles per operation; the TSC is calibrated by
+ * init_clock().
+ *****************************************************************************
+ *****************************************************************************/
+
+#include "type.h"
+#include "stdio.h"
+#include "const.h"
+#include "protect.h"
+#include "string.h"
+#include "fs.h"
+#include "proc.h"
+#include "tty.h"
+#include "console.h"
+#include "global.h"
+#include "proto.h"
+#include "sched.h"
+#include "kinfo.h"
+#include "tsc.h"
+#include "bench.h"
+
+#ifdef MICROBENCH
+
+/* MESSAGE types between the bench procs */
+#define	BENCH_PING		2401
+#define	BENCH_GO		2402
+#define	BENCH_DONE		2403
+
+#define	PROC_MAIN		(NR_TASKS + 0)
+#define	PROC_PONG		(NR_TASKS + 1)
+#define	PROC_YIELD		(NR_TASKS + 2)
+
+PRIVATE u32	bench_lo;	/* when the running benchmark began */
+PRIVATE u32	bench_hi;
+
+PRIVATE void	bench_start	();
+PRIVATE void	bench_stop	(const char* name, int nr_ops);
+
+
+/*****************************************************************************
+ *                                bench_start
+ *****************************************************************************/
+/**
+ * <Ring 3> Start timing.
+ *****************************************************************************/
+PRIVATE void bench_start()
+{
+	rdtsc(bench_lo, bench_hi);
+}
+
+/*****************************************************************************
+ *                                bench_stop
+ *****************************************************************************/
+/**
+ * <Ring 3> Stop timing and print the result, one line per benchmark:
+ *
+ *	BENCH <name> <cycles per op> cycles <ns per op> ns
+ * 
+ * @param name    Name of the benchmark.
+ * @param nr_ops  How many operations were timed.
+ *****************************************************************************/
+PRIVATE void bench_stop(const char* name, int nr_ops)
+{
+	u32 lo, hi, per_op, r;
+	u64 cycles;
+
+	rdtsc(lo, hi);
+	cycles = ((u64)hi << 32 | lo) - ((u64)bench_hi << 32 | bench_lo);
+	div64_32((u32)(cycles >> 32), (u32)cycles, nr_ops, per_op, r);
+
+	printl("BENCH %s %d cycles %d ns\n", name, per_op,
+	       (int)tsc2ns(per_op, 0));
+}
+
+/*****************************************************************************
+ *                                bench_main
+ *****************************************************************************/
+/**
+ * <Ring 3> Run every benchmark once, then block for good so that the CPU
+ * goes to IDLE_PROC and halts.
+ *****************************************************************************/
+PUBLIC void bench_main()
+{
+	MESSAGE msg;
+	int i;
+
+	printl("BENCH BEGIN tsc %d kHz, %d iterations\n",
+	       kinfo.tsc_khz, BENCH_ITERS);
+
+	/* IPC round trip: BOTH to a proc which replies at once */
+	bench_start();
+	for (i = 0; i < BENCH_ITERS; i++) {
+		reset_msg(&msg);
+		msg.type = BENCH_PING;
+		send_recv(BOTH, PROC_PONG, &msg);
+	}
+	bench_stop("ipc_pingpong", BENCH_ITERS);
+
+	/* null syscall: printx() of nothing */
+	bench_start();
+	for (i = 0; i < BENCH_ITERS; i++)
+		printx("");
+	bench_stop("null_syscall", BENCH_ITERS);
+
+	/* get_ticks(), which reads the kernel info page */
+	bench_start();
+	for (i = 0; i < BENCH_ITERS; i++)
+		get_ticks();
+	bench_stop("get_ticks", BENCH_ITERS);
+
+	/* yield storm: two procs yielding to each other */
+	reset_msg(&msg);
+	msg.type = BENCH_GO;
+	bench_start();
+	send_recv(SEND, PROC_YIELD, &msg);
+	for (i = 0; i < BENCH_ITERS; i++)
+		yield();
+	send_recv(RECEIVE, PROC_YIELD, &msg);
+	assert(msg.type == BENCH_DONE);
+	bench_stop("yield", BENCH_ITERS * 2);
+
+	/* the trap cost seen from inside the kernel, see trap_exit() */
+	printl("BENCH traps %d min %d max %d cycles\n",
+	       kinfo.nr_traps, kinfo.trap_min, kinfo.trap_max);
+	printl("BENCH END\n");
+
+	while (1)
+		send_recv(RECEIVE, INTERRUPT, &msg); /* never comes */
+}
+
+/*****************************************************************************
+ *                                bench_pong
+ *****************************************************************************/
+/**
+ * <Ring 3> Reply to every BENCH_PING.
+ *****************************************************************************/
+PUBLIC void bench_pong()
+{
+	MESSAGE msg;
+
+	while (1) {
+		send_recv(RECEIVE, ANY, &msg);
+		assert(msg.type == BENCH_PING);
+		send_recv(SEND, msg.source, &msg);
+	}
+}
+
+/*****************************************************************************
+ *                                bench_yield
+ *****************************************************************************/
+/**
+ * <Ring 3> On BENCH_GO, yield BENCH_ITERS times, then report BENCH_DONE.
+ *****************************************************************************/
+PUBLIC void bench_yield()
+{
+	MESSAGE msg;
+	int i;
+
+	while (1) {
+		send_recv(RECEIVE, PROC_MAIN, &msg);
+		assert(msg.type == BENCH_GO);
+
+		for (i = 0; i < BENCH_ITERS; i++)
+			yield();
+
+		reset_msg(&msg);
+		msg.type = BENCH_DONE;
+		send_recv(SEND, PROC_MAIN, &msg);
+	}
+}
+
+#endif /* MICROBENCH */
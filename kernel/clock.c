@@ -18,8 +18,60 @@
 #include "console.h"
 #include "global.h"
 #include "proto.h"
+#include "kinfo.h"
+#include "timer.h"
+#include "sched.h"
+#include "tsc.h"
 
 
+/**
+ * The kernel info page. Page aligned, and nothing else shares the page.
+ */
+PUBLIC struct kinfo kinfo __attribute__((aligned(4096)));
+
+PRIVATE struct timer	timers[NR_TASKS + NR_PROCS];
+PRIVATE struct timer *	wheel[NR_TIMER_SLOTS];
+PRIVATE struct timer *	expired;	/* fired, not picked up by SYS yet */
+PRIVATE u32		wheel_now;	/* never wraps like `ticks' does */
+
+PRIVATE int		lapse = 1;	/* ticks the PIT is set to span */
+
+#ifdef TICKLESS
+/**
+ * Time is kept in PIT counts between clock interrupts: the PIT may be set
+ * again in the middle of an interval (see clock_resync()), and a proc may
+ * run for part of one.
+ */
+PRIVATE u32		lapse_units = TICK_UNITS; /* the interval, in counts */
+PRIVATE u32		pit_mark = TICK_UNITS;	/* the counter when last read */
+PRIVATE u32		clock_units;	/* gone by, not made ticks yet */
+PRIVATE struct proc *	tick_proc;	/* who has run since pit_mark */
+PRIVATE u32		run_units[NR_TASKS + NR_PROCS + 1]; /* not charged yet */
+PRIVATE int		resync_pending;	/* a timer has been armed */
+
+/**
+ * The armed timer which expires first, 0 if none; kept by set_timer(), so
+ * that next_timer() only has to look at all timers when it is gone.
+ */
+PRIVATE struct timer *	earliest;
+PRIVATE int		earliest_stale;	/* it went, not known which is next */
+#endif
+
+PRIVATE u32		trap_tsc_lo;	/* when the current trap began */
+PRIVATE u32		trap_tsc_hi;
+PRIVATE int		trap_pending;
+PRIVATE struct proc *	trap_proc;	/* who trapped */
+
+PRIVATE void	timer_unlink	(struct timer* t);
+PRIVATE void	run_wheel	();
+PRIVATE void	calibrate_tsc	();
+PRIVATE void	charge		(struct proc* p, int nr_ticks);
+#ifdef TICKLESS
+PRIVATE void	charge_units	(struct proc* p, u32 units);
+PRIVATE int	next_timer	();
+PRIVATE void	set_next_tick	();
+#endif
+
 /*****************************************************************************
  *                                clock_handler
  *****************************************************************************/
@@ -31,33 +83,39 @@
  *****************************************************************************/
 PUBLIC void clock_handler(int irq)
 {
-	if (++ticks >= MAX_TICKS)
-		ticks = 0;
-
-	if (p_proc_ready->ticks)
-	   {
-		p_proc_ready->ticks--;
-//**************************************************************
+	int i, n;
 
-//every time runs, count add one
-		p_proc_ready->run_count++;
-		}
+#ifdef TICKLESS
+	/* the rest of the interval, down from pit_mark, has gone by */
+	clock_units += pit_mark;
+	charge_units(tick_proc, pit_mark);
+	pit_mark = lapse_units;	/* in periodic mode the PIT starts over */
+	tick_proc = p_proc_ready;
 
-//if has run for 20 time,lowing the priority
+	n = clock_units / TICK_UNITS;
+	clock_units %= TICK_UNITS;
+#else
+	/* `lapse' ticks have gone by since the last clock interrupt */
+	n = lapse;
+	charge(p_proc_ready, n);
+#endif
 
-	if(p_proc_ready->run_count >= p_proc_ready->priority/2){
-		p_proc_ready->ticks = 0;
-		p_proc_ready->priority = p_proc_ready->priority/2;
-		if(p_proc_ready->priority == 0){
-			p_proc_ready->priority = 1;
-		}
-	        p_proc_ready->run_count = 0;	
+	for (i = 0; i < n; i++) {
+		if (++ticks >= MAX_TICKS)
+			ticks = 0;
+		run_wheel();
 	}
-//*****************************************************************
+	kinfo.ticks = ticks;
+
+	sched_clock(n);
 
 	if (key_pressed)
 		inform_int(TASK_TTY);
 
+#ifdef TICKLESS
+	set_next_tick();
+#endif
+
 	if (k_reenter != 0) {
 		return;
 	}
@@ -70,19 +128,413 @@ PUBLIC void clock_handler(int irq)
 
 }
 
+/*****************************************************************************
+ *                                run_wheel
+ *****************************************************************************/
+/**
+ * <Ring 0> Advance the timer wheel by one tick. Timers due now are moved to
+ * the `expired' list and TASK_SYS is told to wake their owners up.
+ *****************************************************************************/
+PRIVATE void run_wheel()
+{
+	struct timer* t;
+	struct timer* next;
+	int fired = 0;
+
+	wheel_now++;
+	for (t = wheel[wheel_now & (NR_TIMER_SLOTS - 1)]; t; t = next) {
+		next = t->next;
+		if ((int)(t->expire - wheel_now) > 0)
+			continue;	/* due in a later round */
+
+		timer_unlink(t);
+		t->next = expired;
+		expired = t;
+		fired = 1;
+	}
+
+	if (fired)
+		inform_int(TASK_SYS);
+}
+
+/*****************************************************************************
+ *                                charge
+ *****************************************************************************/
+/**
+ * <Ring 0> Charge ticks a proc has run to it.
+ * 
+ * @param p         The proc, IDLE_PROC included.
+ * @param nr_ticks  How many ticks.
+ *****************************************************************************/
+PRIVATE void charge(struct proc* p, int nr_ticks)
+{
+	if (p == proc_table + IDLE_PROC)
+		kinfo.idle_ticks += nr_ticks;
+
+	sched_charge(p, nr_ticks);
+}
+
+#ifdef TICKLESS
+/*****************************************************************************
+ *                                charge_units
+ *****************************************************************************/
+/**
+ * <Ring 0> Charge PIT counts a proc has run to it, in whole ticks; what is
+ * less than a tick is kept for next time.
+ * 
+ * @param p      The proc, 0 if none yet.
+ * @param units  How many PIT counts.
+ *****************************************************************************/
+PRIVATE void charge_units(struct proc* p, u32 units)
+{
+	u32* left;
+
+	if (!p)
+		return;
+
+	left = &run_units[proc2pid(p)];
+	*left += units;
+	if (*left >= TICK_UNITS) {
+		charge(p, *left / TICK_UNITS);
+		*left %= TICK_UNITS;
+	}
+}
+
+/*****************************************************************************
+ *                                next_timer
+ *****************************************************************************/
+/**
+ * <Ring 0> How far away the nearest armed timer is. The timers are only
+ * looked through when the one which was nearest has fired or been taken
+ * off.
+ * 
+ * @return In ticks, MAX_LAPSE if no timer is closer than that.
+ *****************************************************************************/
+PRIVATE int next_timer()
+{
+	struct timer* t;
+
+	if (earliest_stale) {
+		earliest = 0;
+		for (t = timers; t < timers + NR_TASKS + NR_PROCS; t++)
+			if (t->armed && (!earliest ||
+			    (int)(t->expire - earliest->expire) < 0))
+				earliest = t;
+		earliest_stale = 0;
+	}
+
+	if (!earliest)
+		return MAX_LAPSE;
+	return min(MAX_LAPSE, max((int)(earliest->expire - wheel_now), 1));
+}
+
+/*****************************************************************************
+ *                                set_next_tick
+ *****************************************************************************/
+/**
+ * <Ring 0> Decide when the next clock interrupt is needed and program the
+ * PIT for it. Nothing can happen before the nearest timer fires or the
+ * current proc uses up its ticks, so there is no point in interrupting
+ * before that. IDLE_PROC only waits for the timer. When it is one tick
+ * away anyway, or a reschedule is coming, stay periodic.
+ *
+ * The counts which have gone by since the last tick (clock_units) are
+ * taken off a one-shot, so that it ends on a tick.
+ *****************************************************************************/
+PRIVATE void set_next_tick()
+{
+	struct proc* p = p_proc_ready;
+	int n = 1;
+
+	if (key_pressed) {
+		n = 1;
+	}
+	else if (p == proc_table + IDLE_PROC) {
+		/* only a timer or an interrupt can end idling */
+		n = next_timer();
+	}
+	else if (k_reenter == 0 && p->ticks > 0) {
+		n = min(MAX_LAPSE, p->ticks);
+		n = min(n, next_timer());
+	}
+
+	if (n == 1) {
+		if (lapse != 1) {
+			out_byte(TIMER_MODE, RATE_GENERATOR);
+			out_byte(TIMER0, (u8) (TIMER_FREQ/HZ) );
+			out_byte(TIMER0, (u8) ((TIMER_FREQ/HZ) >> 8));
+			lapse_units = pit_mark = TICK_UNITS;
+		}
+	}
+	else {
+		int units = n * TICK_UNITS - (int)clock_units;
+		if (units < TICK_UNITS)
+			units = TICK_UNITS;
+
+		out_byte(TIMER_MODE, ONE_SHOT);
+		out_byte(TIMER0, (u8) units);
+		out_byte(TIMER0, (u8) (units >> 8));
+		lapse_units = pit_mark = units;
+	}
+	lapse = n;
+}
+#endif
+
+/*****************************************************************************
+ *                                clock_resync
+ *****************************************************************************/
+/**
+ * <Ring 0> Called by `restart', with interrupts off. If another proc is
+ * about to run, or a timer has been armed, the interval chosen by the last
+ * clock interrupt may be too long: charge the counts gone by since then to
+ * whoever ran in them, and program the PIT again for the new situation.
+ *
+ * Nothing to do without TICKLESS, the clock interrupts every tick anyway.
+ *****************************************************************************/
+PUBLIC void clock_resync()
+{
+#ifdef TICKLESS
+	u32 cur;
+
+	if (p_proc_ready == tick_proc && !resync_pending)
+		return;
+	resync_pending = 0;
+
+	out_byte(TIMER_MODE, LATCH_COUNTER0);
+	cur = in_byte(TIMER0);
+	cur |= in_byte(TIMER0) << 8;
+
+	/* over: its interrupt is on the way, and will do it all */
+	if (cur == 0 || cur > pit_mark)
+		return;
+
+	clock_units += pit_mark - cur;
+	charge_units(tick_proc, pit_mark - cur);
+	pit_mark = cur;
+	tick_proc = p_proc_ready;
+
+	set_next_tick();
+#endif
+}
+
+/*****************************************************************************
+ *                                timer_unlink
+ *****************************************************************************/
+/**
+ * <Ring 0> Take an armed timer off the wheel.
+ * 
+ * @param t  The timer.
+ *****************************************************************************/
+PRIVATE void timer_unlink(struct timer* t)
+{
+	assert(t->armed);
+
+	if (t->prev)
+		t->prev->next = t->next;
+	else
+		wheel[t->expire & (NR_TIMER_SLOTS - 1)] = t->next;
+	if (t->next)
+		t->next->prev = t->prev;
+
+	t->prev = t->next = 0;
+	t->armed = 0;
+#ifdef TICKLESS
+	if (t == earliest) {
+		earliest = 0;
+		earliest_stale = 1;
+	}
+#endif
+}
+
+/*****************************************************************************
+ *                                set_timer
+ *****************************************************************************/
+/**
+ * <Ring 0~1> Arm the timer of a proc, replacing the old one if any. With
+ * TICKLESS the PIT is set again on the way out of the kernel, in case the
+ * timer is due before the next clock interrupt.
+ * 
+ * @param proc_nr   Whose timer.
+ * @param nr_ticks  After how many ticks it fires, at least 1.
+ *****************************************************************************/
+PUBLIC void set_timer(int proc_nr, int nr_ticks)
+{
+	struct timer* t = &timers[proc_nr];
+	struct timer** slot;
+
+	assert(proc_nr >= 0 && proc_nr < NR_TASKS + NR_PROCS);
+
+	disable_int();
+	if (t->armed)
+		timer_unlink(t);
+
+	t->expire = wheel_now + max(nr_ticks, 1);
+	t->armed = 1;
+
+	slot = &wheel[t->expire & (NR_TIMER_SLOTS - 1)];
+	t->prev = 0;
+	t->next = *slot;
+	if (*slot)
+		(*slot)->prev = t;
+	*slot = t;
+#ifdef TICKLESS
+	if (!earliest_stale &&
+	    (!earliest || (int)(t->expire - earliest->expire) < 0))
+		earliest = t;
+	resync_pending = 1;	/* it may be due before the next interrupt */
+#endif
+	enable_int();
+}
+
+/*****************************************************************************
+ *                                next_expired
+ *****************************************************************************/
+/**
+ * <Ring 0~1> Pick up a timer which has fired.
+ * 
+ * @return The proc nr of its owner, or -1 if there is none.
+ *****************************************************************************/
+PUBLIC int next_expired()
+{
+	struct timer* t;
+
+	disable_int();
+	t = expired;
+	if (t)
+		expired = t->next;
+	enable_int();
+
+	if (!t)
+		return -1;
+
+	t->next = 0;
+	return t - timers;
+}
+
 /*****************************************************************************
  *                                milli_delay
  *****************************************************************************/
 /**
- * <Ring 1~3> Delay for a specified amount of time.
+ * <Ring 1~3> Delay for a specified amount of time. The caller sleeps on
+ * the timer wheel instead of spinning, so the CPU goes to others.
+ * 
+ * @note Not for TASK_SYS, which is the one who wakes sleepers up.
  * 
  * @param milli_sec How many milliseconds to delay.
  *****************************************************************************/
 PUBLIC void milli_delay(int milli_sec)
 {
-        int t = get_ticks();
+	MESSAGE msg;
+
+	if (milli_sec <= 0)
+		return;
+
+	reset_msg(&msg);
+	msg.type = SLEEP;
+	msg.CNT = (milli_sec * HZ + 999) / 1000; /* round up to ticks */
+	send_recv(BOTH, TASK_SYS, &msg);
+}
+
+/*****************************************************************************
+ *                                calibrate_tsc
+ *****************************************************************************/
+/**
+ * <Ring 0> Count TSC cycles while 8253 counter 2 counts down CALIBRATE_MS
+ * milliseconds, then work out how to turn cycles into nanoseconds. Must be
+ * called with interrupts off.
+ *****************************************************************************/
+PRIVATE void calibrate_tsc()
+{
+	u32 latch = TIMER_FREQ * CALIBRATE_MS / 1000;
+	u32 lo0, hi0, lo1, hi1, r;
+	int shift;
+
+	/* gate counter 2 on, speaker off; mode 0, LSB then MSB */
+	out_byte(PPI_B, (in_byte(PPI_B) & ~SPEAKER_ON) | TIMER2_GATE);
+	out_byte(TIMER_MODE, 0xB0);
+	out_byte(TIMER2, (u8)latch);
+	out_byte(TIMER2, (u8)(latch >> 8));
+
+	rdtsc(lo0, hi0);
+	while (!(in_byte(PPI_B) & TIMER2_OUT)) {}
+	rdtsc(lo1, hi1);
+
+	kinfo.tsc_khz = (lo1 - lo0) / CALIBRATE_MS;
+	assert(kinfo.tsc_khz);
+
+	/**
+	 * ns_mult = 10^6 * 2^shift / tsc_khz, with shift as large as it can
+	 * be while ns_mult still fits in 32 bits.
+	 */
+	for (shift = 32; shift > 0; shift--) {
+		u64 n = (u64)1000000 << shift;
+		if ((u32)(n >> 32) < kinfo.tsc_khz) {
+			div64_32((u32)(n >> 32), (u32)n, kinfo.tsc_khz,
+				 kinfo.ns_mult, r);
+			break;
+		}
+	}
+	kinfo.ns_shift = shift;
+}
+
+/*****************************************************************************
+ *                                tsc2ns
+ *****************************************************************************/
+/**
+ * <Ring 0~3> Turn TSC cycles into nanoseconds.
+ * 
+ * @param lo  Bits 0~31 of the cycles.
+ * @param hi  Bits 32~63 of the cycles.
+ * 
+ * @return Nanoseconds.
+ *****************************************************************************/
+PUBLIC u64 tsc2ns(u32 lo, u32 hi)
+{
+	return ((u64)lo * kinfo.ns_mult >> kinfo.ns_shift) +
+	       ((u64)hi * kinfo.ns_mult << (32 - kinfo.ns_shift));
+}
 
-        while(((get_ticks() - t) * 1000 / HZ) < milli_sec) {}
+/*****************************************************************************
+ *                                trap_enter
+ *****************************************************************************/
+/**
+ * <Ring 0> Called by sys_call right after `save'.
+ *****************************************************************************/
+PUBLIC void trap_enter()
+{
+	rdtsc(trap_tsc_lo, trap_tsc_hi);
+	trap_proc = p_proc_ready;
+	trap_pending = 1;
+}
+
+/*****************************************************************************
+ *                                trap_exit
+ *****************************************************************************/
+/**
+ * <Ring 0> Called by `restart'. If a syscall is returning, account for how
+ * long it took since trap_enter().
+ *****************************************************************************/
+PUBLIC void trap_exit()
+{
+	u32 lo, hi, t;
+
+	if (!trap_pending)
+		return;
+	trap_pending = 0;
+
+	/* IDLE_PROC traps to halt, that is no cost of the trap */
+	if (trap_proc == proc_table + IDLE_PROC)
+		return;
+
+	rdtsc(lo, hi);
+	t = lo - trap_tsc_lo; /* no trap takes 2^32 cycles */
+
+	kinfo.nr_traps++;
+	kinfo.trap_cycles += t;
+	if (kinfo.nr_traps == 1 || t < kinfo.trap_min)
+		kinfo.trap_min = t;
+	if (t > kinfo.trap_max)
+		kinfo.trap_max = t;
 }
 
 /*****************************************************************************
@@ -94,11 +546,17 @@ PUBLIC void milli_delay(int milli_sec)
  *****************************************************************************/
 PUBLIC void init_clock()
 {
+        calibrate_tsc();
+
         /* 初始化 8253 PIT */
         out_byte(TIMER_MODE, RATE_GENERATOR);
         out_byte(TIMER0, (u8) (TIMER_FREQ/HZ) );
         out_byte(TIMER0, (u8) ((TIMER_FREQ/HZ) >> 8));
 
+        kinfo.ticks = ticks;
+        kinfo.hz = HZ;
+        kinfo.idle_ticks = 0;
+
         put_irq_handler(CLOCK_IRQ, clock_handler);    /* 设定时钟中断处理程序 */
         enable_irq(CLOCK_IRQ);                        /* 让8259A可以接收时钟中断 */
 }
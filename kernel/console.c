@@ -19,6 +19,7 @@
 #include "global.h"
 #include "keyboard.h"
 #include "proto.h"
+#include "frame.h"
 
 /* #define __TTY_DEBUG__ */
 
@@ -29,6 +30,18 @@ PUBLIC void	flush(CONSOLE* con);
 PRIVATE	void	w_copy(unsigned int dst, const unsigned int src, int size);
 PUBLIC void	clear_screen(int pos, int len);
 PUBLIC void out_char(CONSOLE* con, char ch);
+PRIVATE void	crtc_scroll(CONSOLE* con, int dir);
+PRIVATE void	settle_cursor(CONSOLE* con);
+PRIVATE void	rotate(CONSOLE* con);
+
+/**
+ * Set when a console which is not on the screen wraps around: the lines
+ * before its cursor are made contiguous only when it is selected.
+ */
+PRIVATE int	wrap_pending[NR_CONSOLES];
+
+PRIVATE struct frame	frames[NR_CONSOLES];
+
 /*****************************************************************************
  *                                init_screen
  *****************************************************************************/
@@ -84,59 +97,270 @@ PUBLIC void init_screen(TTY* tty)
  *****************************************************************************/
 PUBLIC void out_char(CONSOLE* con, char ch)
 {
-	u8* pch = (u8*)(V_MEM_BASE + con->cursor * 2);
+	console_write(con, &ch, 1);
+}
 
-	assert(con->cursor - con->orig < con->con_size);
 
-	/*
-	 * calculate the coordinate of cursor in current console (not in
-	 * current screen)
-	 */
-	int cursor_x = (con->cursor - con->orig) % SCR_WIDTH;
-	int cursor_y = (con->cursor - con->orig) / SCR_WIDTH;
+/*****************************************************************************
+ *                                console_write
+ *****************************************************************************/
+/**
+ * Print a buffer in a certain console.
+ *
+ * Chars up to the end of a line are put into the video memory in one go,
+ * and the CRTC registers are written only once, after the whole buffer.
+ * They go to the screen even if a frame is being drawn, and that frame will
+ * be written in full.
+ * 
+ * @param con  The console to which the chars are printed.
+ * @param buf  The chars.
+ * @param len  How many.
+ *****************************************************************************/
+PUBLIC void console_write(CONSOLE* con, const char* buf, int len)
+{
+	const char * end = buf + len;
+	struct frame * f = &frames[con - console_table];
 
-	switch(ch) {
-	case '\n':
-		con->cursor = con->orig + SCR_WIDTH * (cursor_y + 1);
-		break;
-	case '\b':
-		if (con->cursor > con->orig) {
+	f->front_valid = 0;
+
+	while (buf < end) {
+		u16* pw = (u16*)(V_MEM_BASE + con->cursor * 2);
+
+		assert(con->cursor - con->orig < con->con_size);
+
+		/*
+		 * calculate the coordinate of cursor in current console (not
+		 * in current screen)
+		 */
+		int cursor_x = (con->cursor - con->orig) % SCR_WIDTH;
+		int cursor_y = (con->cursor - con->orig) / SCR_WIDTH;
+
+		/* the printable chars left on this line */
+		int n = 0;
+		while (n < SCR_WIDTH - cursor_x && buf + n < end &&
+		       buf[n] != '\n' && buf[n] != '\b') {
+			pw[n] = (DEFAULT_CHAR_COLOR << 8) | (u8)buf[n];
+			n++;
+		}
+
+		if (n) {
+			con->cursor += n;
+			buf += n;
+		}
+		else if (*buf++ == '\n') {
+			con->cursor = con->orig + SCR_WIDTH * (cursor_y + 1);
+		}
+		else if (con->cursor > con->orig) { /* '\b' */
 			con->cursor--;
-			*(pch - 2) = ' ';
-			*(pch - 1) = DEFAULT_CHAR_COLOR;
+			*(pw - 1) = (DEFAULT_CHAR_COLOR << 8) | ' ';
 		}
-		break;
-	default:
-		*pch++ = ch;
-		*pch++ = DEFAULT_CHAR_COLOR;
-		con->cursor++;
-		break;
+
+		settle_cursor(con);
 	}
 
+	flush(con);
+}
+
+
+/*****************************************************************************
+ *                                settle_cursor
+ *****************************************************************************/
+/**
+ * Keep the cursor in the console and on the screen after it has moved,
+ * without touching the CRTC: the caller flush()es once it is done.
+ *
+ * A console is a ring of lines. Going down a line only moves the screen
+ * (crtc_start); past the last line the cursor goes on from the first one,
+ * and only then are lines copied, by rotate(), to keep the screen
+ * contiguous. A console which is not on the screen does not even do that
+ * until it is selected.
+ * 
+ * @param con  The console.
+ *****************************************************************************/
+PRIVATE void settle_cursor(CONSOLE* con)
+{
 	if (con->cursor - con->orig >= con->con_size) {
-		cursor_x = (con->cursor - con->orig) % SCR_WIDTH;
-		cursor_y = (con->cursor - con->orig) / SCR_WIDTH;
-		int cp_orig = con->orig + (cursor_y + 1) * SCR_WIDTH - SCR_SIZE;
-		w_copy(con->orig, cp_orig, SCR_SIZE - SCR_WIDTH);
-		con->crtc_start = con->orig;
-		con->cursor = con->orig + (SCR_SIZE - SCR_WIDTH) + cursor_x;
+		con->cursor -= con->con_size;
 		clear_screen(con->cursor, SCR_WIDTH);
 		if (!con->is_full)
 			con->is_full = 1;
+
+		if (is_current_console(con))
+			rotate(con);
+		else
+			wrap_pending[con - console_table] = 1;
 	}
 
 	assert(con->cursor - con->orig < con->con_size);
 
 	while (con->cursor >= con->crtc_start + SCR_SIZE ||
 	       con->cursor < con->crtc_start) {
-		scroll_screen(con, SCR_UP);
+		crtc_scroll(con, SCR_UP);
 
 		clear_screen(con->cursor, SCR_WIDTH);
 	}
+}
+
+
+/*****************************************************************************
+ *                                rotate
+ *****************************************************************************/
+/**
+ * Make the last screenful of a console, up to the cursor line, contiguous
+ * at its beginning and put the screen there. Nothing is copied if the
+ * cursor line is far enough from the beginning already.
+ *
+ * Right after a wrap-around, that is a copy of SCR_SIZE - SCR_WIDTH words.
+ * 
+ * @param con  The console.
+ *****************************************************************************/
+PRIVATE void rotate(CONSOLE* con)
+{
+	int lines = SCR_SIZE / SCR_WIDTH;
+	int cursor_y = (con->cursor - con->orig) / SCR_WIDTH;
+	int shift = lines - 1 - cursor_y; /* lines above the top wrapped */
+
+	if (shift <= 0) {
+		con->crtc_start = con->orig + (cursor_y - lines + 1) * SCR_WIDTH;
+		return;
+	}
+
+	/* lines 0..cursor_y go down, the wrapped ones come up from the end */
+	w_copy(con->orig + shift * SCR_WIDTH, con->orig,
+	       (cursor_y + 1) * SCR_WIDTH);
+	w_copy(con->orig, con->orig + con->con_size - shift * SCR_WIDTH,
+	       shift * SCR_WIDTH);
+
+	con->cursor += shift * SCR_WIDTH;
+	con->crtc_start = con->orig;
+}
+
+/*****************************************************************************
+ *                                frame_begin
+ *****************************************************************************/
+/**
+ * Start drawing a new frame of a console on a blank back buffer.
+ * 
+ * @param con    The console.
+ * @param owner  Whose writes are drawn in the frame.
+ *****************************************************************************/
+PUBLIC void frame_begin(CONSOLE* con, int owner)
+{
+	struct frame * f = &frames[con - console_table];
+	int i;
+
+	for (i = 0; i < SCR_SIZE; i++)
+		f->back[i] = (DEFAULT_CHAR_COLOR << 8) | ' ';
+	f->cursor = 0;
+	f->owner = owner;
+	f->since = get_ticks();
+	f->on = 1;
+}
+
+
+/*****************************************************************************
+ *                                in_frame
+ *****************************************************************************/
+/**
+ * Tell whether what a proc writes to a console goes to the back buffer.
+ * A frame someone else has left open for FRAME_TIMEOUT ticks is ended.
+ * 
+ * @param con  The console.
+ * @param src  Who writes, NO_TASK if no proc does.
+ * 
+ * @return  Non-zero if src is drawing a frame of con.
+ *****************************************************************************/
+PUBLIC int in_frame(CONSOLE* con, int src)
+{
+	struct frame * f = &frames[con - console_table];
+
+	if (!f->on)
+		return 0;
+	if (f->owner == src)
+		return 1;
+
+	if (get_ticks() - f->since > FRAME_TIMEOUT)
+		frame_end(con);
+	return 0;
+}
+
+
+/*****************************************************************************
+ *                                frame_write
+ *****************************************************************************/
+/**
+ * Print a buffer in the back buffer of a console. Nothing scrolls: what
+ * goes past the bottom of the screen is dropped.
+ * 
+ * @param con  The console, which is in a frame.
+ * @param buf  The chars.
+ * @param len  How many.
+ *****************************************************************************/
+PUBLIC void frame_write(CONSOLE* con, const char* buf, int len)
+{
+	struct frame * f = &frames[con - console_table];
+
+	assert(f->on);
+
+	for (; len > 0; len--, buf++) {
+		if (*buf == '\n') {
+			f->cursor = (f->cursor / SCR_WIDTH + 1) * SCR_WIDTH;
+			if (f->cursor > SCR_SIZE)
+				f->cursor = SCR_SIZE;
+		}
+		else if (*buf == '\b') {
+			if (f->cursor > 0)
+				f->back[--f->cursor] =
+					(DEFAULT_CHAR_COLOR << 8) | ' ';
+		}
+		else if (f->cursor < SCR_SIZE) {
+			f->back[f->cursor++] =
+				(DEFAULT_CHAR_COLOR << 8) | (u8)*buf;
+		}
+	}
+}
 
+
+/*****************************************************************************
+ *                                frame_end
+ *****************************************************************************/
+/**
+ * Show the frame drawn since frame_begin() at the beginning of the
+ * console: only the cells which changed since the last frame are written
+ * to the video memory. Everything is written if anything else has been
+ * printed or scrolled in between.
+ * 
+ * @param con  The console.
+ *****************************************************************************/
+PUBLIC void frame_end(CONSOLE* con)
+{
+	struct frame * f = &frames[con - console_table];
+	u16 * v = (u16*)(V_MEM_BASE + con->orig * 2);
+	int i;
+
+	if (!f->on)
+		return;
+
+	if (con->crtc_start != con->orig)
+		f->front_valid = 0;
+
+	for (i = 0; i < SCR_SIZE; i++) {
+		if (!f->front_valid || f->back[i] != f->front[i]) {
+			v[i] = f->back[i];
+			f->front[i] = f->back[i];
+		}
+	}
+	f->front_valid = 1;
+	f->on = 0;
+	wrap_pending[con - console_table] = 0; /* the screen is contiguous */
+
+	con->crtc_start = con->orig;
+	con->cursor = con->orig + f->cursor;
+	settle_cursor(con);
 	flush(con);
 }
 
+
 /*****************************************************************************
  *                                clear_screen
  *****************************************************************************/
@@ -223,6 +447,11 @@ PUBLIC void select_console(int nr_console)
 {
 	if ((nr_console < 0) || (nr_console >= NR_CONSOLES)) return;
 
+	if (wrap_pending[nr_console]) {
+		rotate(&console_table[nr_console]);
+		wrap_pending[nr_console] = 0;
+	}
+
 	flush(&console_table[current_console = nr_console]);
 }
 
@@ -247,6 +476,23 @@ PUBLIC void select_console(int nr_console)
  *              SCR_DN : scroll the screen downwards
  *****************************************************************************/
 PUBLIC void scroll_screen(CONSOLE* con, int dir)
+{
+	crtc_scroll(con, dir);
+	flush(con);
+}
+
+
+/*****************************************************************************
+ *                                crtc_scroll
+ *****************************************************************************/
+/**
+ * Move the screen of a console by a line, see scroll_screen(). Only
+ * con->crtc_start is changed; the CRTC is left to flush().
+ * 
+ * @param con   The console whose screen is to be scrolled.
+ * @param dir   SCR_UP or SCR_DN.
+ *****************************************************************************/
+PRIVATE void crtc_scroll(CONSOLE* con, int dir)
 {
 	/*
 	 * variables below are all in-console-offsets (based on con->orig)
@@ -291,8 +537,6 @@ PUBLIC void scroll_screen(CONSOLE* con, int dir)
 	else {
 		assert(dir == SCR_DN || dir == SCR_UP);
 	}
-
-	flush(con);
 }
 
 
@@ -330,10 +574,13 @@ PUBLIC void flush(CONSOLE* con)
  *                                w_copy
  *****************************************************************************/
 /**
- * Copy data in WORDS.
+ * Copy data in WORDS, within the video memory. The areas may overlap.
  *
  * Note that the addresses of dst and src are not pointers, but integers, 'coz
  * in most cases we pass integers into it as parameters.
+ *
+ * Two words are moved at a time: every access to the video memory is slow,
+ * a byte copy (phys_copy) takes twice as many.
  * 
  * @param dst   Addr of destination.
  * @param src   Addr of source.
@@ -341,8 +588,28 @@ PUBLIC void flush(CONSOLE* con)
  *****************************************************************************/
 PRIVATE	void w_copy(unsigned int dst, const unsigned int src, int size)
 {
-	phys_copy((void*)(V_MEM_BASE + (dst << 1)),
-		  (void*)(V_MEM_BASE + (src << 1)),
-		  size << 1);
+	u16 * d = (u16*)(V_MEM_BASE + (dst << 1));
+	u16 * s = (u16*)(V_MEM_BASE + (src << 1));
+	int n = size >> 1;
+
+	if (d < s) {
+		u32 * dd = (u32*)d;
+		u32 * ss = (u32*)s;
+		while (n--)
+			*dd++ = *ss++;
+		if (size & 1)
+			*(u16*)dd = *(u16*)ss;
+	}
+	else if (d > s) {
+		u32 * dd = (u32*)(d + size);
+		u32 * ss = (u32*)(s + size);
+		if (size & 1) {
+			dd = (u32*)((u16*)dd - 1);
+			ss = (u32*)((u16*)ss - 1);
+			*(u16*)dd = *(u16*)ss;
+		}
+		while (n--)
+			*--dd = *--ss;
+	}
 }
 
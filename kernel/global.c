@@ -17,9 +17,11 @@
 #include "proc.h"
 #include "global.h"
 #include "proto.h"
+#include "sched.h"
+#include "bench.h"
 
 
-PUBLIC	struct proc	proc_table[NR_TASKS + NR_PROCS];
+PUBLIC	struct proc	proc_table[NR_TASKS + NR_PROCS + 1]; /* + IDLE_PROC */
 
 PUBLIC	struct task	task_table[NR_TASKS] = {
 	{task_tty, STACK_SIZE_TTY, "TTY"},
@@ -27,13 +29,23 @@ PUBLIC	struct task	task_table[NR_TASKS] = {
 	{task_hd,  STACK_SIZE_HD,  "HD" },
 	{task_fs,  STACK_SIZE_FS,  "FS" }};
 
+#ifdef MICROBENCH
+PUBLIC	struct task	user_proc_table[NR_PROCS] = {
+	{bench_main,  STACK_SIZE_TESTA, "BMain"},
+	{bench_pong,  STACK_SIZE_TESTB, "BPong"},
+	{bench_yield, STACK_SIZE_TESTC, "BYield"}};
+#else
 PUBLIC	struct task	user_proc_table[NR_PROCS] = {
 	{TestA, STACK_SIZE_TESTA, "TestA"},
 	{TestB, STACK_SIZE_TESTB, "TestB"},
 	{TestC, STACK_SIZE_TESTC, "TestC"}};
+#endif
 
 PUBLIC	char		task_stack[STACK_SIZE_TOTAL];
 
+PUBLIC	struct task	idle_task = {idle, STACK_SIZE_IDLE, "IDLE"};
+PUBLIC	char		idle_stack[STACK_SIZE_IDLE];
+
 PUBLIC	TTY		tty_table[NR_CONSOLES];
 PUBLIC	CONSOLE		console_table[NR_CONSOLES];
 
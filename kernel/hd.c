@@ -20,35 +20,91 @@
 #include "global.h"
 #include "proto.h"
 #include "hd.h"
+#include "ata.h"
+#include "ipc.h"
+#include "grant.h"
+#include "trace.h"
 
 
 PRIVATE void	init_hd			();
 PRIVATE void	hd_open			(int device);
 PRIVATE void	hd_close		(int device);
-PRIVATE void	hd_rdwt			(MESSAGE * p);
+PRIVATE void	hd_enqueue		(MESSAGE * p);
+PRIVATE void	hd_queue_add		(struct hd_req* r);
+PRIVATE int	hd_req_ok		(struct hd_req* r);
+PRIVATE void	hd_fail			(struct hd_req* r);
+PRIVATE void	hd_reply		(int src, MESSAGE* p);
+PRIVATE void	hd_start		();
+PRIVATE void	pio_start		();
+PRIVATE void	hd_intr			();
+PRIVATE void	hd_finish		();
+PRIVATE void	hd_drain		();
+PRIVATE void	pio_block		(struct hd_req** run, int* idx,
+					 int* off, int bytes, int read);
 PRIVATE void	hd_ioctl		(MESSAGE * p);
 PRIVATE void	hd_cmd_out		(struct hd_cmd* cmd);
+PRIVATE void	hd_cmd_out_ext		(struct hd_cmd* cmd,
+					 struct hd_cmd_hob* hob);
 PRIVATE void	get_part_table		(int drive, int sect_nr, struct part_ent * entry);
 PRIVATE void	partition		(int device, int style);
 PRIVATE void	print_hdinfo		(struct hd_info * hdi);
 PRIVATE int	waitfor			(int mask, int val, int timeout);
 PRIVATE void	interrupt_wait		();
 PRIVATE	void	hd_identify		(int drive);
+PRIVATE void	set_multiple		(int drive, int max);
+PRIVATE u32	pci_read		(int bus, int dev, int func, int reg);
+PRIVATE void	bm_probe		();
+PRIVATE int	prd_fill		(struct hd_req** run, int nr);
+PRIVATE void	dma_start		(struct hd_cmd* cmd,
+					 struct hd_cmd_hob* hob, int read);
+PRIVATE int	dma_done		();
 PRIVATE void	print_identify_info	(u16* hdinfo);
 
 PRIVATE	u8		hd_status;
 PRIVATE	u8		hdbuf[SECTOR_SIZE * 2];
 PRIVATE	struct hd_info	hd_info[1];
+PRIVATE	int		mult_sects[1];	/* sectors per DRQ block */
+PRIVATE	int		lba48[1];	/* the drive has 48-bit commands */
+PRIVATE	int		bm_base;	/* BMDMA registers, 0 if none */
+PRIVATE	struct prd	prdt[NR_PRDS]	/* < 8K, so it can't cross 64K */
+				__attribute__((aligned(8192)));
+
+PRIVATE	struct hd_req	hd_reqs[NR_HD_REQS];
+PRIVATE	struct hd_req *	hd_free;	/* unused hd_reqs */
+PRIVATE	struct hd_req *	hd_queue;	/* pending, by sector nr */
+PRIVATE	u64		hd_head;	/* sector after the last done */
+
+/* the run in flight */
+PRIVATE	int		hd_state;	/* HD_IDLE, HD_DMA or HD_PIO */
+PRIVATE	struct hd_req *	hd_run[NR_MERGE];
+PRIVATE	int		hd_run_nr;
+PRIVATE	int		hd_run_sects;
+PRIVATE	int		hd_ext;		/* by an EXT command */
+PRIVATE	struct hd_cmd	hd_cur;
+PRIVATE	struct hd_cmd_hob hd_cur_hob;
+PRIVATE	int		hd_sects_left;	/* by PIO */
+PRIVATE	int		hd_idx;		/* the next byte is */
+PRIVATE	int		hd_off;		/* hd_run[hd_idx]->la + hd_off */
 
 #define	DRV_OF_DEV(dev) (dev <= MAX_PRIM ? \
 			 dev / NR_PRIM_PER_DRIVE : \
 			 (dev - MINOR_hd1a) / NR_SUB_PER_DRIVE)
 
+/**
+ * BSY and DRQ settle within microseconds: waitfor() polls the status
+ * register this many ticks before it starts sleeping between polls.
+ */
+#define	WAITFOR_SPIN_TICKS	1
+
 /*****************************************************************************
  *                                task_hd
  *****************************************************************************/
 /**
  * Main loop of HD driver.
+ *
+ * A transfer does not hold the loop up: once the command is out TASK_HD
+ * goes back to RECEIVE, queueing requests that come meanwhile, and the
+ * HARD_INT from hd_handler() moves the transfer on.
  * 
  *****************************************************************************/
 PUBLIC void task_hd()
@@ -63,7 +119,13 @@ PUBLIC void task_hd()
 		int src = msg.source;
 
 		switch (msg.type) {
+		case HARD_INT:
+			hd_intr();
+			src = NO_TASK;
+			break;
+
 		case DEV_OPEN:
+			hd_drain();	/* partition() talks to the drive */
 			hd_open(msg.DEVICE);
 			break;
 
@@ -73,7 +135,10 @@ PUBLIC void task_hd()
 
 		case DEV_READ:
 		case DEV_WRITE:
-			hd_rdwt(&msg);
+		case DEV_READ_S:
+		case DEV_WRITE_S:
+			hd_enqueue(&msg);
+			src = NO_TASK;	/* replied by hd_finish() */
 			break;
 
 		case DEV_IOCTL:
@@ -86,7 +151,15 @@ PUBLIC void task_hd()
 			break;
 		}
 
-		send_recv(SEND, src, &msg);
+		if (src != NO_TASK)
+			hd_reply(src, &msg);
+
+		/**
+		 * Start the next run only when nobody else is waiting to send
+		 * a request, so that they can all be sorted and merged.
+		 */
+		if (hd_state == HD_IDLE && hd_queue && !has_senders(TASK_HD))
+			hd_start();
 	}
 }
 
@@ -113,6 +186,17 @@ PRIVATE void init_hd()
 	for (i = 0; i < (sizeof(hd_info) / sizeof(hd_info[0])); i++)
 		memset(&hd_info[i], 0, sizeof(hd_info[0]));
 	hd_info[0].open_cnt = 0;
+
+	hd_free = 0;
+	for (i = 0; i < NR_HD_REQS; i++) {
+		hd_reqs[i].next = hd_free;
+		hd_free = &hd_reqs[i];
+	}
+	hd_queue = 0;
+	hd_head = 0;
+	hd_state = HD_IDLE;
+
+	bm_probe();
 }
 
 /*****************************************************************************
@@ -156,63 +240,639 @@ PRIVATE void hd_close(int device)
 
 
 /*****************************************************************************
- *                                hd_rdwt
+ *                                hd_enqueue
  *****************************************************************************/
 /**
- * <Ring 1> This routine handles DEV_READ and DEV_WRITE message.
+ * <Ring 1> This routine handles DEV_READ and DEV_WRITE message, and their
+ * grant flavors DEV_READ_S and DEV_WRITE_S, in which the buffer is given by
+ * a grant id instead of (PROC_NR, BUF). The request is put into hd_queue,
+ * and replied to by hd_finish() once it is done.
+ *
+ * A bad grant gets CNT = 0 back at once and the disk is not touched; so
+ * does a request of 0 bytes, and one whose sender is not waiting for the
+ * reply (it came by SENDA): hd_finish() must not block on it.
+ *
+ * Each proc has at most one request in the queue, since it waits for the
+ * reply, so there is always a free hd_req.
  * 
  * @param p Message ptr.
  *****************************************************************************/
-PRIVATE void hd_rdwt(MESSAGE * p)
+PRIVATE void hd_enqueue(MESSAGE * p)
 {
 	int drive = DRV_OF_DEV(p->DEVICE);
+	int read = (p->type == DEV_READ || p->type == DEV_READ_S);
+
+	if (!awaits_from(p->source, TASK_HD)) {
+		p->CNT = 0;
+		hd_reply(p->source, p);
+		return;
+	}
+	assert(hd_free);
+
+	void * la;
+	if (p->type == DEV_READ_S || p->type == DEV_WRITE_S) {
+		/* reading from the disk means writing into the grant */
+		la = grant_la(TASK_HD, p->GRANT, 0, p->CNT,
+			      read ? GRANT_WRITE : GRANT_READ);
+		if (!la)
+			p->CNT = 0;
+	}
+	else {
+		la = (void*)va2la(p->PROC_NR, p->BUF);
+	}
+
+	if (p->CNT <= 0) {
+		p->CNT = 0;
+		send_recv(SEND, p->source, p);
+		return;
+	}
 
 	u64 pos = p->POSITION;
-	assert((pos >> SECTOR_SIZE_SHIFT) < (1 << 31));
 
 	/**
 	 * We only allow to R/W from a SECTOR boundary:
 	 */
 	assert((pos & 0x1FF) == 0);
 
-	u32 sect_nr = (u32)(pos >> SECTOR_SIZE_SHIFT); /* pos / SECTOR_SIZE */
+	u64 sect_nr = pos >> SECTOR_SIZE_SHIFT; /* pos / SECTOR_SIZE */
 	int logidx = (p->DEVICE - MINOR_hd1a) % NR_SUB_PER_DRIVE;
 	sect_nr += p->DEVICE < MAX_PRIM ?
 		hd_info[drive].primary[p->DEVICE].base :
 		hd_info[drive].logical[logidx].base;
 
-	struct hd_cmd cmd;
-	cmd.features	= 0;
-	cmd.count	= (p->CNT + SECTOR_SIZE - 1) / SECTOR_SIZE;
-	cmd.lba_low	= sect_nr & 0xFF;
-	cmd.lba_mid	= (sect_nr >>  8) & 0xFF;
-	cmd.lba_high	= (sect_nr >> 16) & 0xFF;
-	cmd.device	= MAKE_DEVICE_REG(1, drive, (sect_nr >> 24) & 0xF);
-	cmd.command	= (p->type == DEV_READ) ? ATA_READ : ATA_WRITE;
-	hd_cmd_out(&cmd);
+	struct hd_req * r = hd_free;
+	hd_free = r->next;
+
+	r->msg		= *p;
+	r->src		= p->source;
+	r->drive	= drive;
+	r->read		= read;
+	r->sect_nr	= sect_nr;
+	r->nr_sects	= (p->CNT + SECTOR_SIZE - 1) / SECTOR_SIZE;
+	r->la		= la;
+	r->bytes	= p->CNT;
+
+	hd_queue_add(r);
+}
+
+/*****************************************************************************
+ *                                hd_queue_add
+ *****************************************************************************/
+/**
+ * <Ring 1> Put a request into hd_queue, which is kept sorted by (drive,
+ * sector nr).
+ * 
+ * @param r  The request.
+ *****************************************************************************/
+PRIVATE void hd_queue_add(struct hd_req* r)
+{
+	struct hd_req ** pp = &hd_queue;
+
+	while (*pp && ((*pp)->drive < r->drive ||
+		       ((*pp)->drive == r->drive &&
+			(*pp)->sect_nr <= r->sect_nr)))
+		pp = &(*pp)->next;
+	r->next = *pp;
+	*pp = r;
+}
+
+/*****************************************************************************
+ *                                hd_req_ok
+ *****************************************************************************/
+/**
+ * <Ring 1> Check that the buffer of a queued request is still there: a
+ * grant may have been revoked, or its owner gone, since the request came.
+ * 
+ * @param r  The request.
+ * 
+ * @return One if it can be done, zero if not.
+ *****************************************************************************/
+PRIVATE int hd_req_ok(struct hd_req* r)
+{
+	if (r->msg.type != DEV_READ_S && r->msg.type != DEV_WRITE_S)
+		return 1;
+
+	/* what is left of it: the last `bytes' of the grant */
+	return grant_la(TASK_HD, r->msg.GRANT, r->msg.CNT - r->bytes,
+			r->bytes, r->read ? GRANT_WRITE : GRANT_READ) == r->la;
+}
+
+/*****************************************************************************
+ *                                hd_fail
+ *****************************************************************************/
+/**
+ * <Ring 1> Reply CNT = 0 to a request which has been taken off hd_queue,
+ * and free it.
+ * 
+ * @param r  The request.
+ *****************************************************************************/
+PRIVATE void hd_fail(struct hd_req* r)
+{
+	r->msg.CNT = 0;
+	send_recv(SEND, r->src, &r->msg);
+	r->next = hd_free;
+	hd_free = r;
+}
+
+/*****************************************************************************
+ *                                hd_reply
+ *****************************************************************************/
+/**
+ * <Ring 1> Reply to a request which is not queued. One which came by
+ * SENDA is answered by SENDA, so that TASK_HD never blocks on a proc who
+ * is not listening; the answer is lost if its mailbox is full.
+ * 
+ * @param src  Whom to reply to.
+ * @param p    The reply.
+ *****************************************************************************/
+PRIVATE void hd_reply(int src, MESSAGE* p)
+{
+	send_recv(awaits_from(src, TASK_HD) ? SEND : SENDA, src, p);
+}
 
-	int bytes_left = p->CNT;
-	void * la = (void*)va2la(p->PROC_NR, p->BUF);
+/*****************************************************************************
+ *                                hd_start
+ *****************************************************************************/
+/**
+ * <Ring 1> Start the next request in C-LOOK order: the first one at or
+ * after the sector where the last one ended, or the lowest one if there is
+ * none -- the heads only sweep upwards. The requests right after it which
+ * go on sector by sector in the same direction are done by the same
+ * command. The run goes into hd_run[] and the command is sent out; the
+ * rest is up to hd_intr().
+ *
+ * A request whose grant has gone meanwhile is replied CNT = 0 instead.
+ *
+ * A request longer than the drive can do in one command (256 sectors
+ * without LBA48) gets only its first part done; hd_finish() puts the rest
+ * back into hd_queue.
+ *
+ * Whole sectors go by DMA if there is a bus master IDE controller,
+ * otherwise by PIO (see pio_start()). The 48-bit (EXT) commands are used
+ * when the drive has them and the run is beyond LBA28 or longer than 256
+ * sectors.
+ *****************************************************************************/
+PRIVATE void hd_start()
+{
+	struct hd_req * prev = 0;
+	struct hd_req * r;
+
+	assert(hd_state == HD_IDLE);
+
+	while (1) {
+		prev = 0;
+		for (r = hd_queue; r && r->sect_nr < hd_head; r = r->next)
+			prev = r;
+		if (!r) {
+			prev = 0;
+			r = hd_queue;
+		}
+
+		if (hd_req_ok(r))
+			break;
+
+		if (prev)
+			prev->next = r->next;
+		else
+			hd_queue = r->next;
+		hd_fail(r);
+		if (!hd_queue)
+			return;
+	}
+
+	int drive = r->drive;
+	int read = r->read;
+	int max_sects = lba48[drive] ? LBA48_MAX_COUNT : LBA28_MAX_COUNT;
+	int nr = 0;
+	int nr_sects = min(r->nr_sects, max_sects);
+	struct hd_req * last = r;
+
+	r->xfer = nr_sects == r->nr_sects ? r->bytes : nr_sects * SECTOR_SIZE;
+	hd_run[nr++] = r;
+	while (nr_sects == r->nr_sects && nr < NR_MERGE && last->next &&
+	       !(last->bytes % SECTOR_SIZE) &&
+	       last->next->drive == drive &&
+	       last->next->read == read &&
+	       last->next->sect_nr == last->sect_nr + last->nr_sects &&
+	       nr_sects + last->next->nr_sects <= max_sects &&
+	       hd_req_ok(last->next)) {
+		last = last->next;
+		last->xfer = last->bytes;
+		hd_run[nr++] = last;
+		nr_sects += last->nr_sects;
+	}
+
+	/* hd_run[] is a piece of hd_queue */
+	if (prev)
+		prev->next = last->next;
+	else
+		hd_queue = last->next;
+
+	u64 sect_nr = r->sect_nr;
+	hd_head = sect_nr + nr_sects;
+	hd_run_nr = nr;
+	hd_run_sects = nr_sects;
+
+	hd_ext = lba48[drive] && (sect_nr + nr_sects > LBA28_SECTS ||
+				  nr_sects > LBA28_MAX_COUNT);
+	if (hd_ext)
+		assert(nr_sects <= LBA48_MAX_COUNT &&
+		       (sect_nr + nr_sects) >> 48 == 0);
+	else
+		assert(nr_sects <= LBA28_MAX_COUNT &&
+		       sect_nr + nr_sects <= LBA28_SECTS);
+
+	/* a count of 0 means 256 (LBA28) or 65536 (LBA48) */
+	hd_cur.features	= 0;
+	hd_cur.count	= nr_sects & 0xFF;
+	hd_cur.lba_low	= sect_nr & 0xFF;
+	hd_cur.lba_mid	= (sect_nr >>  8) & 0xFF;
+	hd_cur.lba_high	= (sect_nr >> 16) & 0xFF;
+	hd_cur.device	= MAKE_DEVICE_REG(1, drive,
+					  hd_ext ? 0 : (sect_nr >> 24) & 0xF);
+
+	hd_cur_hob.count	= (nr_sects >> 8) & 0xFF;
+	hd_cur_hob.lba_low	= (sect_nr >> 24) & 0xFF;
+	hd_cur_hob.lba_mid	= (sect_nr >> 32) & 0xFF;
+	hd_cur_hob.lba_high	= (sect_nr >> 40) & 0xFF;
+
+	if (bm_base && prd_fill(hd_run, nr)) {
+		if (hd_ext)
+			hd_cur.command = read ? ATA_READ_DMA_EXT :
+						ATA_WRITE_DMA_EXT;
+		else
+			hd_cur.command = read ? ATA_READ_DMA : ATA_WRITE_DMA;
+		dma_start(&hd_cur, hd_ext ? &hd_cur_hob : 0, read);
+		hd_state = HD_DMA;
+		return;
+	}
+
+	pio_start();
+}
+
+/*****************************************************************************
+ *                                pio_start
+ *****************************************************************************/
+/**
+ * <Ring 1> Send out the command of hd_run[] for PIO. With READ/WRITE
+ * MULTIPLE an interrupt comes once every mult_sects[drive] sectors, and
+ * whole sectors go straight between the port and the callers' buffers;
+ * only a partial last sector goes through hdbuf.
+ *
+ * A write has its first DRQ block filled here; every interrupt after that
+ * asks for the next one.
+ *****************************************************************************/
+PRIVATE void pio_start()
+{
+	int drive = hd_run[0]->drive;
+	int read = hd_run[0]->read;
+	int mult = mult_sects[drive];
+
+	if (mult > 1 && hd_ext)
+		hd_cur.command = read ? ATA_READ_MULTIPLE_EXT :
+					ATA_WRITE_MULTIPLE_EXT;
+	else if (mult > 1)
+		hd_cur.command = read ? ATA_READ_MULTIPLE :
+					ATA_WRITE_MULTIPLE;
+	else if (hd_ext)
+		hd_cur.command = read ? ATA_READ_EXT : ATA_WRITE_EXT;
+	else
+		hd_cur.command = read ? ATA_READ : ATA_WRITE;
+	hd_cmd_out_ext(&hd_cur, hd_ext ? &hd_cur_hob : 0);
+
+	hd_sects_left = hd_run_sects;
+	hd_idx = 0;
+	hd_off = 0;
+	hd_state = HD_PIO;
+
+	if (!read) {
+		int n = min(mult, hd_sects_left);
+
+		if (!waitfor(STATUS_DRQ, STATUS_DRQ, HD_TIMEOUT))
+			panic("hd writing error.");
+
+		pio_block(hd_run, &hd_idx, &hd_off, n * SECTOR_SIZE, read);
+		hd_sects_left -= n;
+	}
+}
+
+/*****************************************************************************
+ *                                hd_intr
+ *****************************************************************************/
+/**
+ * <Ring 1> Move the run in flight on, by the HARD_INT that hd_handler()
+ * sends with the status register in hd_status.
+ *
+ * A DMA run is over, or is done again by PIO if DMA failed. A PIO read has
+ * a DRQ block to be taken; a PIO write has the last block taken, and the
+ * next one is given if any. If the drive reports an error, the requests of
+ * the run get CNT = 0 and the drive is free for the next run.
+ *****************************************************************************/
+PRIVATE void hd_intr()
+{
+	if (hd_state == HD_IDLE)
+		return;		/* nothing in flight */
+
+	if (hd_state == HD_DMA) {
+		if (dma_done())
+			hd_finish();
+		else
+			pio_start();	/* bm_base is 0 now */
+		return;
+	}
+
+	int read = hd_run[0]->read;
+	int i;
 
-	while (bytes_left) {
-		int bytes = min(SECTOR_SIZE, bytes_left);
-		if (p->type == DEV_READ) {
-			interrupt_wait();
-			port_read(REG_DATA, hdbuf, SECTOR_SIZE);
-			phys_copy(la, (void*)va2la(TASK_HD, hdbuf), bytes);
+	if (hd_status & (STATUS_ERR | STATUS_DFSE)) {
+		printl("HD: %s error, status 0x%x, error 0x%x\n",
+		       read ? "reading" : "writing", hd_status,
+		       in_byte(REG_ERROR));
+		for (i = 0; i < hd_run_nr; i++)
+			hd_fail(hd_run[i]);
+		hd_run_nr = 0;
+		hd_state = HD_IDLE;
+		return;
+	}
+
+	if (!read && hd_sects_left == 0) {
+		hd_finish();
+		return;
+	}
+
+	int n = min(mult_sects[hd_run[0]->drive], hd_sects_left);
+
+	if (!read && !waitfor(STATUS_DRQ, STATUS_DRQ, HD_TIMEOUT))
+		panic("hd writing error.");
+
+	pio_block(hd_run, &hd_idx, &hd_off, n * SECTOR_SIZE, read);
+	hd_sects_left -= n;
+
+	if (read && hd_sects_left == 0)
+		hd_finish();
+}
+
+/*****************************************************************************
+ *                                hd_finish
+ *****************************************************************************/
+/**
+ * <Ring 1> The run in flight is done: reply to every request of it, but
+ * the one which has only had its first part done, which goes back into
+ * hd_queue for the rest.
+ *****************************************************************************/
+PRIVATE void hd_finish()
+{
+	int i;
+
+	for (i = 0; i < hd_run_nr; i++) {
+		struct hd_req * r = hd_run[i];
+
+		if (r->xfer < r->bytes) {
+			r->sect_nr  += r->xfer / SECTOR_SIZE;
+			r->nr_sects -= r->xfer / SECTOR_SIZE;
+			r->la       += r->xfer;
+			r->bytes    -= r->xfer;
+			hd_queue_add(r);
+			continue;
+		}
+
+		send_recv(SEND, r->src, &r->msg);
+		r->next = hd_free;
+		hd_free = r;
+	}
+	hd_run_nr = 0;
+	hd_state = HD_IDLE;
+}
+
+/*****************************************************************************
+ *                                hd_drain
+ *****************************************************************************/
+/**
+ * <Ring 1> Wait until the run in flight is done, for those who talk to the
+ * drive themselves with interrupt_wait().
+ *****************************************************************************/
+PRIVATE void hd_drain()
+{
+	while (hd_state != HD_IDLE) {
+		interrupt_wait();
+		hd_intr();
+	}
+}
+
+/*****************************************************************************
+ *                                pio_block
+ *****************************************************************************/
+/**
+ * <Ring 1> Move a DRQ block between the data port and the buffers of a
+ * run of requests, as few port_read()/port_write() as possible.
+ * 
+ * @param run    The requests.
+ * @param idx    In/out: the request the next byte belongs to.
+ * @param off    In/out: the offset of the next byte in its buffer.
+ * @param bytes  Size of the block, whole sectors.
+ * @param read   Whether the drive is read.
+ *****************************************************************************/
+PRIVATE void pio_block(struct hd_req** run, int* idx, int* off, int bytes,
+		       int read)
+{
+	while (bytes > 0) {
+		struct hd_req * r = run[*idx];
+		void * la = r->la + *off;
+		int left = r->xfer - *off;
+		int chunk = min(bytes, left) / SECTOR_SIZE * SECTOR_SIZE;
+
+		if (chunk) {
+			if (read)
+				port_read(REG_DATA, la, chunk);
+			else
+				port_write(REG_DATA, la, chunk);
+			bytes -= chunk;
 		}
 		else {
-			if (!waitfor(STATUS_DRQ, STATUS_DRQ, HD_TIMEOUT))
-				panic("hd writing error.");
+			/* a partial last sector goes through hdbuf */
+			chunk = left;
+			if (read) {
+				port_read(REG_DATA, hdbuf, SECTOR_SIZE);
+				phys_copy(la, (void*)va2la(TASK_HD, hdbuf),
+					  chunk);
+			}
+			else {
+				memset(hdbuf, 0, SECTOR_SIZE);
+				phys_copy((void*)va2la(TASK_HD, hdbuf), la,
+					  chunk);
+				port_write(REG_DATA, hdbuf, SECTOR_SIZE);
+			}
+			bytes -= SECTOR_SIZE;
+		}
+
+		*off += chunk;
+		if (*off == r->xfer) {
+			(*idx)++;
+			*off = 0;
+		}
+	}
+}
+
+
+/*****************************************************************************
+ *                                pci_read
+ *****************************************************************************/
+/**
+ * <Ring 1> Read a dword from the PCI configuration space.
+ * 
+ * @param bus   Bus nr.
+ * @param dev   Device nr.
+ * @param func  Function nr.
+ * @param reg   Register offset.
+ * 
+ * @return The dword, 0xFFFFFFFF if there is no such function.
+ *****************************************************************************/
+PRIVATE u32 pci_read(int bus, int dev, int func, int reg)
+{
+	u32 val;
 
-			port_write(REG_DATA, la, bytes);
-			interrupt_wait();
+	out_dword(PCI_CONFIG_ADDR, PCI_ADDR(bus, dev, func, reg));
+	in_dword(PCI_CONFIG_DATA, val);
+	return val;
+}
+
+/*****************************************************************************
+ *                                bm_probe
+ *****************************************************************************/
+/**
+ * <Ring 1> Look for a bus master IDE controller (PIIX3/4 and the like) on
+ * PCI bus 0, enable it as a bus master and set bm_base to its BAR4. Leave
+ * bm_base 0 if there is none.
+ *****************************************************************************/
+PRIVATE void bm_probe()
+{
+	int dev, func;
+
+	bm_base = 0;
+
+	for (dev = 0; dev < 32; dev++) {
+		for (func = 0; func < 8; func++) {
+			if (pci_read(0, dev, func, PCI_ID) == 0xFFFFFFFF)
+				continue;
+
+			u32 class = pci_read(0, dev, func, PCI_CLASS);
+			u32 bar4 = pci_read(0, dev, func, PCI_BAR4);
+			if ((class >> 16) != PCI_CLASS_IDE ||
+			    !(class & (PCI_IDE_BUSMASTER << 8)) ||
+			    !(bar4 & 1))	/* not in the I/O space */
+				continue;
+
+			u32 cmd = pci_read(0, dev, func, PCI_COMMAND);
+			out_dword(PCI_CONFIG_ADDR,
+				  PCI_ADDR(0, dev, func, PCI_COMMAND));
+			out_dword(PCI_CONFIG_DATA,
+				  (cmd & 0xFFFF) | PCI_CMD_IO | PCI_CMD_MASTER);
+
+			bm_base = bar4 & 0xFFFC;
+			printl("BMDMA: 0x%x (pci 0:%d.%d)\n", bm_base, dev, func);
+			return;
 		}
-		bytes_left -= SECTOR_SIZE;
-		la += SECTOR_SIZE;
 	}
-}															
 
+	printl("BMDMA: none, PIO only\n");
+}
+
+/*****************************************************************************
+ *                                prd_fill
+ *****************************************************************************/
+/**
+ * <Ring 1> Describe the buffers of a run of requests in prdt[]. Linear
+ * addresses are physical ones here (the kernel maps memory 1:1).
+ * 
+ * @param run  The requests.
+ * @param nr   How many.
+ * 
+ * @return One if success, zero if a buffer is not whole sectors or not
+ *         word aligned, or if they need more than NR_PRDS regions.
+ *****************************************************************************/
+PRIVATE int prd_fill(struct hd_req** run, int nr)
+{
+	int i = 0;
+	int k;
+
+	for (k = 0; k < nr; k++) {
+		u32 addr = (u32)run[k]->la;
+		int bytes = run[k]->xfer;
+
+		if ((addr & 1) || (bytes % SECTOR_SIZE))
+			return 0;
+
+		while (bytes > 0) {
+			if (i == NR_PRDS)
+				return 0;
+
+			/* up to the next 64K boundary */
+			int chunk = min(0x10000 - (addr & 0xFFFF), bytes);
+			prdt[i].base  = addr;
+			prdt[i].count = chunk & 0xFFFF;
+			prdt[i].flags = 0;
+
+			addr += chunk;
+			bytes -= chunk;
+			i++;
+		}
+	}
+	prdt[i - 1].flags = PRD_EOT;
+
+	return 1;
+}
+
+/*****************************************************************************
+ *                                dma_start
+ *****************************************************************************/
+/**
+ * <Ring 1> Start a READ DMA or WRITE DMA over the regions in prdt[]. The
+ * CPU is free until the one interrupt at the end, see dma_done().
+ * 
+ * @param cmd   The command, ATA_READ_DMA(_EXT) or ATA_WRITE_DMA(_EXT).
+ * @param hob   The high order bytes of an EXT command, 0 otherwise.
+ * @param read  Whether the device writes memory.
+ *****************************************************************************/
+PRIVATE void dma_start(struct hd_cmd* cmd, struct hd_cmd_hob* hob, int read)
+{
+	int dir = read ? BM_CMD_READ : 0;
+
+	out_byte(bm_base + BM_CMD, 0);
+	out_dword(bm_base + BM_PRDT, (u32)va2la(TASK_HD, prdt));
+	out_byte(bm_base + BM_STATUS, BM_ST_ERR | BM_ST_INT); /* clear */
+	out_byte(bm_base + BM_CMD, dir);
+
+	hd_cmd_out_ext(cmd, hob);
+	out_byte(bm_base + BM_CMD, dir | BM_CMD_START);
+}
+
+/*****************************************************************************
+ *                                dma_done
+ *****************************************************************************/
+/**
+ * <Ring 1> Stop the bus master once the drive has interrupted.
+ *
+ * If the controller or the drive reports an error, DMA is given up for
+ * good (bm_base = 0) and the caller falls back to PIO.
+ * 
+ * @return One if success, zero if the transfer has to be done by PIO.
+ *****************************************************************************/
+PRIVATE int dma_done()
+{
+	u8 bm_status = in_byte(bm_base + BM_STATUS);
+	out_byte(bm_base + BM_CMD, 0);
+	out_byte(bm_base + BM_STATUS, BM_ST_ERR | BM_ST_INT);
+
+	if ((bm_status & BM_ST_ERR) ||
+	    (hd_status & (STATUS_ERR | STATUS_DFSE))) {
+		printl("BMDMA: error (bm 0x%x, ata 0x%x), PIO from now on\n",
+		       bm_status, hd_status);
+		bm_base = 0;
+		return 0;
+	}
+
+	return 1;
+}
 
 /*****************************************************************************
  *                                hd_ioctl
@@ -395,6 +1055,55 @@ PRIVATE void hd_identify(int drive)
 	hd_info[drive].primary[0].base = 0;
 	/* Total Nr of User Addressable Sectors */
 	hd_info[drive].primary[0].size = ((int)hdinfo[61] << 16) + hdinfo[60];
+
+	/* 48-bit Address feature set: the size is in words 100~103 */
+	lba48[drive] = (hdinfo[83] & 0x0400) != 0;
+	if (lba48[drive]) {
+		u32 n = (hdinfo[102] || hdinfo[103]) ? 0xFFFFFFFF :
+			((u32)hdinfo[101] << 16) + hdinfo[100];
+		/* part_info holds an int: 1TB at most */
+		hd_info[drive].primary[0].size = n > 0x7FFFFFFF ? 0x7FFFFFFF : n;
+	}
+
+	/* Maximum Nr of sectors per DRQ block of READ/WRITE MULTIPLE */
+	set_multiple(drive, hdinfo[47] & 0xFF);
+}
+
+/*****************************************************************************
+ *                                set_multiple
+ *****************************************************************************/
+/**
+ * <Ring 1> Have the drive move several sectors per interrupt in READ/WRITE
+ * MULTIPLE. If it refuses, or allows only one, mult_sects[drive] is 1 and
+ * pio_start() sticks to READ/WRITE SECTORS.
+ * 
+ * @param drive  Drive Nr.
+ * @param max    The most the drive allows, 0 if it has no READ MULTIPLE.
+ *****************************************************************************/
+PRIVATE void set_multiple(int drive, int max)
+{
+	int n = 1;
+
+	while (n * 2 <= min(max, MAX_MULT_SECTS)) /* a power of 2 */
+		n *= 2;
+
+	mult_sects[drive] = 1;
+	if (n == 1)
+		return;
+
+	struct hd_cmd cmd;
+	cmd.features	= 0;
+	cmd.count	= n;
+	cmd.lba_low	= 0;
+	cmd.lba_mid	= 0;
+	cmd.lba_high	= 0;
+	cmd.device	= MAKE_DEVICE_REG(0, drive, 0);
+	cmd.command	= ATA_SET_MULTIPLE;
+	hd_cmd_out(&cmd);
+	interrupt_wait();
+
+	if (!(hd_status & STATUS_ERR))
+		mult_sects[drive] = n;
 }
 
 /*****************************************************************************
@@ -435,8 +1144,10 @@ PRIVATE void print_identify_info(u16* hdinfo)
 	printl("LBA48 supported: %s\n",
 	       (cmd_set_supported & 0x0400) ? "Yes" : "No");
 
-	int sectors = ((int)hdinfo[61] << 16) + hdinfo[60];
-	printl("HD size: %dMB\n", sectors * 512 / 1000000);
+	u32 sectors = (cmd_set_supported & 0x0400) ?
+		((u32)hdinfo[101] << 16) + hdinfo[100] :
+		((u32)hdinfo[61] << 16) + hdinfo[60];
+	printl("HD size: %dMB\n", sectors / (1000000 / 512));
 }
 
 /*****************************************************************************
@@ -448,6 +1159,23 @@ PRIVATE void print_identify_info(u16* hdinfo)
  * @param cmd  The command struct ptr.
  *****************************************************************************/
 PRIVATE void hd_cmd_out(struct hd_cmd* cmd)
+{
+	hd_cmd_out_ext(cmd, 0);
+}
+
+/*****************************************************************************
+ *                                hd_cmd_out_ext
+ *****************************************************************************/
+/**
+ * <Ring 1> Output a command, 48-bit or not, to HD controller.
+ *
+ * The Command Block Registers of a 48-bit command are FIFOs of two bytes:
+ * the high order bytes go in first, then the low order ones.
+ * 
+ * @param cmd  The command struct ptr.
+ * @param hob  The high order bytes of a 48-bit command, 0 for the others.
+ *****************************************************************************/
+PRIVATE void hd_cmd_out_ext(struct hd_cmd* cmd, struct hd_cmd_hob* hob)
 {
 	/**
 	 * For all commands, the host must first check if BSY=1,
@@ -458,6 +1186,13 @@ PRIVATE void hd_cmd_out(struct hd_cmd* cmd)
 
 	/* Activate the Interrupt Enable (nIEN) bit */
 	out_byte(REG_DEV_CTRL, 0);
+	if (hob) {
+		out_byte(REG_FEATURES, 0);
+		out_byte(REG_NSECTOR,  hob->count);
+		out_byte(REG_LBA_LOW,  hob->lba_low);
+		out_byte(REG_LBA_MID,  hob->lba_mid);
+		out_byte(REG_LBA_HIGH, hob->lba_high);
+	}
 	/* Load required parameters in the Command Block Registers */
 	out_byte(REG_FEATURES, cmd->features);
 	out_byte(REG_NSECTOR,  cmd->count);
@@ -467,6 +1202,11 @@ PRIVATE void hd_cmd_out(struct hd_cmd* cmd)
 	out_byte(REG_DEVICE,   cmd->device);
 	/* Write the command code to the Command Register */
 	out_byte(REG_CMD,     cmd->command);
+
+	TRACE_EVENT(TR_HD_CMD, cmd->command,
+		    (hob ? hob->lba_low : cmd->device & 0xF) << 24 |
+		    cmd->lba_high << 16 | cmd->lba_mid << 8 | cmd->lba_low,
+		    (hob ? hob->count << 8 : 0) | cmd->count);
 }
 
 /*****************************************************************************
@@ -486,7 +1226,9 @@ PRIVATE void interrupt_wait()
  *                                waitfor
  *****************************************************************************/
 /**
- * <Ring 1> Wait for a certain status.
+ * <Ring 1> Wait for a certain status. Poll it busily at first, the drive
+ * is usually there in no time; sleep a tick between polls only after
+ * WAITFOR_SPIN_TICKS have gone by.
  * 
  * @param mask    Status mask.
  * @param val     Required status.
@@ -498,11 +1240,14 @@ PRIVATE int waitfor(int mask, int val, int timeout)
 {
 	int t = get_ticks();
 
-	while(((get_ticks() - t) * 1000 / HZ) < timeout)
+	while (1) {
 		if ((in_byte(REG_STATUS) & mask) == val)
 			return 1;
-
-	return 0;
+		if (((get_ticks() - t) * 1000 / HZ) >= timeout)
+			return 0;
+		if (get_ticks() - t > WAITFOR_SPIN_TICKS)
+			milli_delay(1000 / HZ); /* sleep a tick between polls */
+	}
 }
 
 /*****************************************************************************
@@ -522,6 +1267,7 @@ PUBLIC void hd_handler(int irq)
 	 *   - writes to the Command Register.
 	 */
 	hd_status = in_byte(REG_STATUS);
+	TRACE_EVENT(TR_HD_DONE, hd_status, 0, 0);
 
 	inform_int(TASK_HD);
 }
@@ -26,6 +26,11 @@ extern	tss
 extern	disp_pos
 extern	k_reenter
 extern	sys_call_table
+extern	trace_irq_enter
+extern	trace_irq_exit
+extern	trap_enter
+extern	trap_exit
+extern	clock_resync
 
 bits 32
 
@@ -158,7 +163,11 @@ csinit:		; “这个跳转指令强制使用刚刚初始化的结构”——<<O
 	out	INT_M_CTL, al		; /
 	sti	; CPU在响应中断的过程中会自动关中断，这句之后就允许响应新的中断
 	push	%1			; `.
+	call	trace_irq_enter		;  |
+	mov	dword [esp], %1		;  | (callee may clobber its arg)
 	call	[irq_table + 4 * %1]	;  | 中断处理程序
+	mov	dword [esp], %1		;  |
+	call	trace_irq_exit		;  |
 	pop	ecx			; /
 	cli
 	in	al, INT_M_CTLMASK	; `.
@@ -212,7 +221,11 @@ hwint07:		; Interrupt routine for irq 7 (printer)
 	out	INT_S_CTL, al		; /  一定注意：slave和master都要置EOI
 	sti	; CPU在响应中断的过程中会自动关中断，这句之后就允许响应新的中断
 	push	%1			; `.
+	call	trace_irq_enter		;  |
+	mov	dword [esp], %1		;  | (callee may clobber its arg)
 	call	[irq_table + 4 * %1]	;  | 中断处理程序
+	mov	dword [esp], %1		;  |
+	call	trace_irq_exit		;  |
 	pop	ecx			; /
 	cli
 	in	al, INT_S_CTLMASK	; `.
@@ -363,6 +376,11 @@ save:
 sys_call:
         call    save
 
+	call	trap_enter			  ; `. 记下进入内核的时刻(TSC)
+	mov	eax, [esi + EAXREG - P_STACKBASE] ;  | trap_enter 会破坏
+	mov	ecx, [esi + ECXREG - P_STACKBASE] ;  | eax/ecx/edx，
+	mov	edx, [esi + EDXREG - P_STACKBASE] ; /  从进程表中取回
+
         sti
 	push	esi
 
@@ -384,6 +402,8 @@ sys_call:
 ;                                   restart
 ; ====================================================================================
 restart:
+	call	trap_exit	; 若是从系统调用返回，记下用了多少时间
+	call	clock_resync	; 换了进程或定了新的定时器，重设 8253
 	mov	esp, [p_proc_ready]
 	lldt	[esp + P_LDT_SEL] 
 	lea	eax, [esp + P_STACKTOP]
@@ -9,6 +9,14 @@
 #include "console.h"
 #include "global.h"
 #include "proto.h"
+#include "sched.h"
+#include "grant.h"
+#include "kinfo.h"
+#include "stats.h"
+#include "trace.h"
+#include "tsc.h"
+#include "serial.h"
+#include "frame.h"
 
 #include "time.h"
 #include "termio.h"
@@ -326,7 +334,7 @@ void move_down() {
 
 /*刷新界面 */
 void refresh_screen() {
-	clear();
+	tty_frame(TIOCTL_FRAME_BEGIN);
 	printf("\n\n\n");
 	printf("                WELCOME TO THE GAME OF 2048 IN ORANGE KING SYSTEM!\n");
 	printf("                TIPS--W:UP S:DOWN A:LEFT D:RIGHT Q:EXIT---\n");
@@ -389,6 +397,7 @@ void refresh_screen() {
 		printf("\r                   \nDO YOU REALLY WANT TO QUIT THE GAME? [Y/N]:   \b\b");
 
 	}
+	tty_frame(TIOCTL_FRAME_END);
 }
 /*初始化游戏 */
 void init_game() {
@@ -995,24 +1004,28 @@ void showProcessWelcome()
 void showProcess()
 {
 	int i;
+	struct proc_stats st;
 	printf("===============================================================================\n");
-	printf("    ProcessID    |    ProcessName    |    ProcessPriority    |    Running          \n");
-	//进程号，进程名，优先级，是否在运行
+	printf(" ID    Name  Pr State |  User   Sys| Volun Invol|  Sent  Recv| Wait S/R\n");
+	//进程号，进程名，优先级，状态，CPU时间，切换次数，消息数，阻塞时间
 	printf("-------------------------------------------------------------------------------\n");
-	for (i = 0; i < NR_TASKS + NR_PROCS; i++)//逐个遍历
+	for (i = 0; i <= IDLE_PROC; i++)//逐个遍历，包括IDLE
 	{
-		printf("        %d", proc_table[i].pid);
-		printf("                 %5s", proc_table[i].name);
-		printf("                   %2d", proc_table[i].priority);
-		if (proc_table[i].priority == 0)
-		{
-			printf("                   no\n");
-		}
+		get_proc_stats(i, &st);
+		printf(" %2d  %6s  %2d", proc_table[i].pid, proc_table[i].name,
+		       proc_table[i].priority);
+		if (proc_table[i].p_flags == -1)
+			printf("  kill ");
+		else if (proc_table[i].p_flags & SENDING)
+			printf("  send ");
+		else if (proc_table[i].p_flags & RECEIVING)
+			printf("  recv ");
 		else
-		{
-			printf("                   yes\n");
-		}
-		//printf("        %d                 %s                   %d                   yes\n", proc_table[i].pid, proc_table[i].name, proc_table[i].priority);
+			printf("  run  ");
+		printf("|%5d %5d| %5d %5d| %5d %5d| %d/%d\n",
+		       st.utime, st.stime, st.nvcsw, st.nivcsw,
+		       st.nr_sent, st.nr_received,
+		       st.sending_ticks, st.receiving_ticks);
 	}
 	printf("===============================================================================\n\n");
 }
@@ -1102,7 +1115,7 @@ void restartProcess(char str[])
 	}
 	else
 	{
-		proc_table[pid].priority = 1;
+		proc_table[pid].priority = PRIO_USER;	/* back in its class */
 		proc_table[pid].p_flags = 1;
 		printf("Target process is running.\n");
 	}
@@ -1140,20 +1153,29 @@ PUBLIC int kernel_main()
 	int   eflags;
 	int   i, j;
 	int   prio;
-	for (i = 0; i < NR_TASKS + NR_PROCS; i++) {
+	for (i = 0; i < NR_TASKS + NR_PROCS + 1; i++) {
 		if (i < NR_TASKS) {     /* 任务 */
 			p_task = task_table + i;
 			privilege = PRIVILEGE_TASK;
 			rpl = RPL_TASK;
 			eflags = 0x1202; /* IF=1, IOPL=1, bit 2 is always 1 */
-			prio = 15;
+			prio = PRIO_TASK;
 		}
-		else {                  /* 用户进程 */
+		else if (i < NR_TASKS + NR_PROCS) { /* 用户进程 */
 			p_task = user_proc_table + (i - NR_TASKS);
 			privilege = PRIVILEGE_USER;
 			rpl = RPL_USER;
 			eflags = 0x202; /* IF=1, bit 2 is always 1 */
-			prio = 5;
+			prio = PRIO_USER;
+		}
+		else {                  /* IDLE_PROC */
+			p_task = &idle_task;
+			privilege = PRIVILEGE_TASK;
+			rpl = RPL_TASK;
+			eflags = 0x1202; /* IF=1, IOPL=1, bit 2 is always 1 */
+			prio = 0;
+			/* not carved out of task_stack */
+			p_task_stack = idle_stack + STACK_SIZE_IDLE;
 		}
 
 		strcpy(p_proc->name, p_task->name);	/* name of the process */
@@ -1203,24 +1225,260 @@ PUBLIC int kernel_main()
 	ticks = 0;
 
 	p_proc_ready = proc_table;
+	init_sched();
 
 	init_clock();
 	init_keyboard();
+	init_serial();
 
 	restart();
 
 	while (1) {}
 }
 
+/*****************************************************************************
+ *                                get_ticks
+ *****************************************************************************/
+/**
+ * <Ring 1~3> Read the clock ticks from the kernel info page: one memory
+ * load, no trap. GET_TICKS to TASK_SYS still works for old callers.
+ * 
+ * @return Ticks since the clock was started.
+ *****************************************************************************/
 PUBLIC int get_ticks()
+{
+	return kinfo.ticks;
+}
+
+/*****************************************************************************
+ *                                clock_gettime
+ *****************************************************************************/
+/**
+ * <Ring 1~3> Time since boot with nanosecond resolution. Like get_ticks(),
+ * it needs no trap: it reads the TSC and converts it with the calibration
+ * in the kernel info page.
+ * 
+ * @param ts  Where to put the time.
+ *****************************************************************************/
+PUBLIC void clock_gettime(struct ktimespec* ts)
+{
+	u32 lo, hi;
+	u64 ns;
+
+	rdtsc(lo, hi);
+	ns = tsc2ns(lo, hi);
+	div64_32((u32)(ns >> 32), (u32)ns, 1000000000, ts->tv_sec, ts->tv_nsec);
+}
+
+/*****************************************************************************
+ *                                get_proc_stats
+ *****************************************************************************/
+/**
+ * Get the CPU and IPC accounting of a proc.
+ * 
+ * @param proc_nr  Whose, IDLE_PROC included.
+ * @param st       Where to put them.
+ * 
+ * @return Zero if success.
+ *****************************************************************************/
+PUBLIC int get_proc_stats(int proc_nr, struct proc_stats* st)
+{
+	MESSAGE msg;
+	reset_msg(&msg);
+	msg.type = GET_PROC_STATS;
+	msg.PROC_NR = proc_nr;
+	msg.BUF = st;
+	send_recv(BOTH, TASK_SYS, &msg);
+	return msg.RETVAL;
+}
+
+/*****************************************************************************
+ *                                make_grant
+ *****************************************************************************/
+/**
+ * Let another proc access a region of the caller's memory.
+ * 
+ * @param grantee  Who may use the grant, ANY for anyone.
+ * @param base     Start of the region.
+ * @param len      Length of the region in bytes.
+ * @param rights   GRANT_READ and/or GRANT_WRITE.
+ * 
+ * @return The grant id to be put in MESSAGE.GRANT, or GRANT_INVALID.
+ *****************************************************************************/
+PUBLIC int make_grant(int grantee, void* base, int len, int rights)
+{
+	MESSAGE msg;
+	reset_msg(&msg);
+	msg.type = GRANT_CREATE;
+	msg.PROC_NR = grantee;
+	msg.BUF = base;
+	msg.CNT = len;
+	msg.FLAGS = rights;
+	send_recv(BOTH, TASK_SYS, &msg);
+	return msg.RETVAL;
+}
+
+/*****************************************************************************
+ *                                revoke_grant
+ *****************************************************************************/
+/**
+ * Revoke a grant made by make_grant().
+ * 
+ * @param id  The grant id.
+ * 
+ * @return Zero if success.
+ *****************************************************************************/
+PUBLIC int revoke_grant(int id)
 {
 	MESSAGE msg;
 	reset_msg(&msg);
-	msg.type = GET_TICKS;
+	msg.type = GRANT_REVOKE;
+	msg.GRANT = id;
 	send_recv(BOTH, TASK_SYS, &msg);
 	return msg.RETVAL;
 }
 
+#ifdef TRACE
+PRIVATE u32 trace_tail;	/* records before it have been dumped */
+
+/*****************************************************************************
+ *                                dumpTrace
+ *****************************************************************************/
+/**
+ * The `trace' command. Drain the kernel trace ring, one record per line:
+ *
+ *	seq tsc_hi tsc_lo ticks type a b c
+ *
+ * between `TRACE BEGIN' and `TRACE END'. tools/tracedec.c turns a capture
+ * of it into latency histograms. Tracing is off while dumping, otherwise
+ * the dump would trace itself over the records not yet dumped.
+ *****************************************************************************/
+void dumpTrace()
+{
+	u32 head;
+	int lost = 0;
+
+	trace_ring.on = 0;
+	head = trace_ring.head;
+	if (head - trace_tail > NR_TRACE_RECS) {
+		lost = head - trace_tail - NR_TRACE_RECS;
+		trace_tail = head - NR_TRACE_RECS;
+	}
+
+	printf("TRACE BEGIN %d lost\n", lost);
+	for (; trace_tail != head; trace_tail++) {
+		struct trace_rec* r =
+			&trace_ring.rec[trace_tail & (NR_TRACE_RECS - 1)];
+		if (r->seq != trace_tail + 1)
+			continue;	/* was being written when we stopped */
+		printf("%d %x %x %d %d %d %d %d\n", r->seq, r->tsc_hi,
+		       r->tsc_lo, r->ticks, r->type, r->a, r->b, r->c);
+	}
+	printf("TRACE END\n");
+
+	trace_ring.on = 1;
+}
+#endif
+
+/*****************************************************************************
+ *                                serialSelect
+ *****************************************************************************/
+/**
+ * The `serial' command: `serial N' mirrors TTY N on COM1, `serial off'
+ * mirrors none. Kernel logs go to COM1 either way.
+ * 
+ * @param arg  What follows `serial' on the command line.
+ *****************************************************************************/
+void serialSelect(char* arg)
+{
+	MESSAGE msg;
+
+	while (*arg == ' ')
+		arg++;
+
+	reset_msg(&msg);
+	msg.type = SERIAL_SELECT;
+	if (!strcmp(arg, "off"))
+		msg.DEVICE = SERIAL_NONE;
+	else if (arg[0] >= '0' && arg[0] < '0' + NR_CONSOLES && !arg[1])
+		msg.DEVICE = arg[0] - '0';
+	else {
+		printf("usage: serial <0~%d> | serial off\n", NR_CONSOLES - 1);
+		return;
+	}
+	send_recv(BOTH, TASK_TTY, &msg);
+}
+
+#ifdef SCHED_BENCH
+#define BENCH_ROUNDS 200
+
+PRIVATE volatile int hog_loops;	/* bumped by TestC */
+
+/*****************************************************************************
+ *                                schedBench
+ *****************************************************************************/
+/**
+ * The `sched' command. The shell (interactive: it sleeps a tick at a time)
+ * competes with TestC (CPU-bound: it never blocks). Reports how late the
+ * shell wakes up, how long a write to the TTY takes, how much work TestC
+ * gets done in the meantime, and how idle the CPU was.
+ *****************************************************************************/
+void schedBench()
+{
+	int i, t, late;
+	int worst = 0, total = 0;
+	int t0 = get_ticks();
+	int loops0 = hog_loops;
+	int idle0 = kinfo.idle_ticks;
+
+	printf("sched: %d rounds of 1-tick sleeps against TestC\n", BENCH_ROUNDS);
+
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		t = get_ticks();
+		milli_delay(1000 / HZ);
+		late = get_ticks() - t - 1;
+		total += late;
+		if (late > worst)
+			worst = late;
+	}
+
+	t = get_ticks();
+	for (i = 0; i < BENCH_ROUNDS; i++)
+		printf(".");
+	printf("\n");
+	int tty_ticks = get_ticks() - t;
+
+	int elapsed = max(get_ticks() - t0, 1);
+	printf("wake-up latency: avg %d/100 ticks, worst %d ticks\n",
+	       total * 100 / BENCH_ROUNDS, worst);
+	printf("tty write: %d chars in %d ticks\n", BENCH_ROUNDS, tty_ticks);
+	printf("TestC: %d loops per tick\n", (hog_loops - loops0) / elapsed);
+	printf("idle: %d of %d ticks\n", kinfo.idle_ticks - idle0, elapsed);
+
+	/* IPC round trip, timed with the TSC */
+	struct ktimespec t1, t2;
+	MESSAGE msg;
+	clock_gettime(&t1);
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		reset_msg(&msg);
+		msg.type = GET_PID;
+		send_recv(BOTH, TASK_SYS, &msg);
+	}
+	clock_gettime(&t2);
+	int ns = (t2.tv_sec - t1.tv_sec) * 1000000000 +
+		 (int)t2.tv_nsec - (int)t1.tv_nsec;
+	printf("IPC round trip to SYS: %d ns\n", ns / BENCH_ROUNDS);
+
+	u32 avg, r;
+	u64 cycles = kinfo.trap_cycles;
+	div64_32((u32)(cycles >> 32), (u32)cycles, max(kinfo.nr_traps, 1),
+		 avg, r);
+	printf("trap: %d traps, cycles min %d avg %d max %d (%d kHz TSC)\n",
+	       kinfo.nr_traps, kinfo.trap_min, avg, kinfo.trap_max,
+	       kinfo.tsc_khz);
+}
+#endif
+
 void TestA()
 {
 	int fd;
@@ -1311,6 +1569,19 @@ void TestA()
 			clear();
 			runFileManage(fd_stdin);
 		}
+		else if (!memcmp(rdbuf, "serial", 6)) {
+			serialSelect(rdbuf + 6);
+		}
+#ifdef TRACE
+		else if (!strcmp(rdbuf, "trace")) {
+			dumpTrace();
+		}
+#endif
+#ifdef SCHED_BENCH
+		else if (!strcmp(rdbuf, "sched")) {
+			schedBench();
+		}
+#endif
 		else if (!strcmp(rdbuf, ""))
 		{
 			continue;
@@ -1336,7 +1607,12 @@ void TestB()
 
 void TestC()
 {
+#ifdef SCHED_BENCH
+	while (1)
+		hog_loops++;
+#else
 	spin("TestC");
+#endif
 }
 
 PUBLIC void panic(const char* fmt, ...)
@@ -1357,14 +1633,27 @@ PUBLIC void panic(const char* fmt, ...)
 
 /* 系统应用：控制台命令行 */
 
-/* 清屏函数 */
+/*****************************************************************************
+ *                                tty_frame
+ *****************************************************************************/
+/**
+ * Send a frame request (see frame.h) to the tty printf() writes to.
+ * 
+ * @param request  TIOCTL_FRAME_BEGIN, TIOCTL_FRAME_END or TIOCTL_FRAME_CLEAR.
+ *****************************************************************************/
+PUBLIC void tty_frame(int request)
+{
+	char req[2];
+
+	req[0] = MAG_CH_FRAME;
+	req[1] = request;
+	write(1, req, 2); /* fd 1 is where printf() goes */
+}
+
+/* 清屏函数: 画一个空帧, 只擦掉屏幕上有字的格子 */
 void clear()
 {
-	/* 清屏 */
-	clear_screen(0, console_table[current_console].cursor);
-	/* 初始化 */
-	console_table[current_console].crtc_start = 0;
-	console_table[current_console].cursor = 0;
+	tty_frame(TIOCTL_FRAME_CLEAR);
 }
 
 
@@ -1389,6 +1678,7 @@ void Booting()
 }
 void emptyWindow()
 {
+	tty_frame(TIOCTL_FRAME_BEGIN);
 	printf("      +------------------------------------------------------------------+\n");
 	printf("      |                                                                  |\n");
 	printf("      |                                                                  |\n");
@@ -1410,11 +1700,13 @@ void emptyWindow()
 	printf("      |                                                                  |\n");
 	printf("      |                                                                  |\n");
 	printf("      +------------------------------------------------------------------+\n");
+	tty_frame(TIOCTL_FRAME_END);
 	milli_delay(DELAY_TIME);
 	clear();
 }
 void gradualStart()
 {
+	tty_frame(TIOCTL_FRAME_BEGIN);
 	printf("      +------------------------------------------------------------------+\n");
 	printf("      |                                                                  |\n");
 	printf("      |                                                                  |\n");
@@ -1436,12 +1728,14 @@ void gradualStart()
 	printf("      |                                                                  |\n");
 	printf("      |                                                                  |\n");
 	printf("      +------------------------------------------------------------------+\n");
+	tty_frame(TIOCTL_FRAME_END);
 	milli_delay(DELAY_TIME);
 	clear();
 
 	milli_delay(DELAY_TIME);
 	clear();
 
+	tty_frame(TIOCTL_FRAME_BEGIN);
 	printf("      +------------------------------------------------------------------+\n");
 	printf("      |                                                                  |\n");
 	printf("      |                                                                  |\n");
@@ -1463,12 +1757,14 @@ void gradualStart()
 	printf("      |                                                                  |\n");
 	printf("      |                                                                  |\n");
 	printf("      +------------------------------------------------------------------+\n");
+	tty_frame(TIOCTL_FRAME_END);
 	milli_delay(DELAY_TIME);
 	clear();
 
 	milli_delay(DELAY_TIME);
 	clear();
 
+	tty_frame(TIOCTL_FRAME_BEGIN);
 	printf("      +------------------------------------------------------------------+\n");
 	printf("      |                                                                  |\n");
 	printf("      |                                                                  |\n");
@@ -1490,11 +1786,13 @@ void gradualStart()
 	printf("      |                                                                  |\n");
 	printf("      |                                                                  |\n");
 	printf("      +------------------------------------------------------------------+\n");
+	tty_frame(TIOCTL_FRAME_END);
 	milli_delay(DELAY_TIME);
 	clear();
 	milli_delay(DELAY_TIME);
 	clear();
 
+	tty_frame(TIOCTL_FRAME_BEGIN);
 	printf("      +------------------------------------------------------------------+\n");
 	printf("      |                                                                  |\n");
 	printf("      |                                                                  |\n");
@@ -1516,12 +1814,14 @@ void gradualStart()
 	printf("      |                                                                  |\n");
 	printf("      |                                                                  |\n");
 	printf("      +------------------------------------------------------------------+\n");
+	tty_frame(TIOCTL_FRAME_END);
 	milli_delay(DELAY_TIME);
 	clear();
 
 	milli_delay(DELAY_TIME);
 	clear();
 
+	tty_frame(TIOCTL_FRAME_BEGIN);
 	printf("      +------------------------------------------------------------------+\n");
 	printf("      |                                                                  |\n");
 	printf("      |                                                                  |\n");
@@ -1543,12 +1843,14 @@ void gradualStart()
 	printf("      |                                                                  |\n");
 	printf("      |                                                                  |\n");
 	printf("      +------------------------------------------------------------------+\n");
+	tty_frame(TIOCTL_FRAME_END);
 	milli_delay(DELAY_TIME);
 	clear();
 
 	milli_delay(DELAY_TIME);
 	clear();
 
+	tty_frame(TIOCTL_FRAME_BEGIN);
 	printf("      +------------------------------------------------------------------+\n");
 	printf("      |                                                                  |\n");
 	printf("      |                                                                  |\n");
@@ -1570,6 +1872,7 @@ void gradualStart()
 	printf("      |                                                                  |\n");
 	printf("      |                                                                  |\n");
 	printf("      +------------------------------------------------------------------+\n");
+	tty_frame(TIOCTL_FRAME_END);
 	milli_delay(DELAY_TIME);
 	clear();
 }
@@ -16,49 +16,409 @@
 #include "proc.h"
 #include "global.h"
 #include "proto.h"
+#include "sched.h"
+#include "ipc.h"
+#include "grant.h"
+#include "stats.h"
+#include "trace.h"
 
 PRIVATE void block(struct proc* p);
 PRIVATE void unblock(struct proc* p);
+PRIVATE void rq_enqueue(struct proc* p);
+PRIVATE void rq_dequeue(struct proc* p);
+PRIVATE struct proc* rq_pick();
+PRIVATE void mlfq_demote(struct proc* p);
+PRIVATE void mlfq_promote(struct proc* p);
+PRIVATE void mlfq_boost();
+PRIVATE void account_wait(struct proc* p);
+PRIVATE void note_sent(int src, int dest, int type);
+PRIVATE void note_received(int pid, int src, int type);
+PRIVATE void idle_halt();
+PRIVATE void handoff(struct proc* from, struct proc* to);
+PRIVATE void end_donation(struct proc* p);
+PRIVATE void drop_donation(struct proc* p);
+PRIVATE void unlink_sender(struct proc* dest, struct proc* sender);
 PRIVATE int  msg_send(struct proc* current, int dest, MESSAGE* m);
 PRIVATE int  msg_receive(struct proc* current, int src, MESSAGE* m);
+PRIVATE int  msg_senda(struct proc* current, int dest, MESSAGE* m);
+PRIVATE int  msg_notify(struct proc* current, int dest);
+PRIVATE int  fetch_async(struct proc* p, int src, MESSAGE* m);
+#ifdef DEADLOCK_CHECK
+PRIVATE int  waits_for(struct proc* p);
 PRIVATE int  deadlock(int src, int dest);
+#endif
+
+PRIVATE struct run_queue	run_queue;
+PRIVATE struct rq_link		rq_links[NR_TASKS + NR_PROCS];
+PRIVATE struct donation		donations[NR_TASKS + NR_PROCS];
+
+/* MLFQ level of each proc, 0 is the top one; see sched.h */
+PRIVATE int			mlfq_level[NR_TASKS + NR_PROCS];
+PRIVATE const int		mlfq_quantum[NR_MLFQ_LEVELS] = {2, 4, 8, 16};
+PRIVATE int			boost_clock;	/* ticks since the last boost */
+
+/**
+ * The sending queue of proc_table[i] is `q_sending' ... q_sending_tail[i],
+ * linked forward by `next_sending' and backward by prev_sending[].
+ */
+PRIVATE struct proc *		q_sending_tail[NR_TASKS + NR_PROCS];
+PRIVATE struct proc *		prev_sending[NR_TASKS + NR_PROCS];
+
+/* non-blocking IPC, see ipc.h */
+PRIVATE struct mailbox		mailboxes[NR_TASKS + NR_PROCS];
+PRIVATE u32			notify_bits[NR_TASKS + NR_PROCS][NR_NOTIFY_WORDS];
+
+/**
+ * reply_pending[i] is set while proc i, having done BOTH, is still blocked
+ * in the SEND half. The RECEIVE half is armed by whoever takes the message.
+ */
+PRIVATE int			reply_pending[NR_TASKS + NR_PROCS];
+
+/**
+ * awaiting_reply[i] is set while proc i is in the RECEIVE half of BOTH. It
+ * takes the partner's SEND only: SENDA and NOTIFY messages from the partner
+ * wait in the mailbox (or notify_bits) for a plain RECEIVE.
+ */
+PRIVATE int			awaiting_reply[NR_TASKS + NR_PROCS];
+
+PRIVATE struct grant		grants[NR_GRANTS];
+
+/* accounting, see stats.h */
+PUBLIC struct proc_stats	proc_stats[NR_TASKS + NR_PROCS + 1]; /* + IDLE_PROC */
+PRIVATE u32			sched_now;	/* ticks, never wraps */
+PRIVATE u32			wait_since[NR_TASKS + NR_PROCS];
+PRIVATE int			wait_flags[NR_TASKS + NR_PROCS];
+
+/*****************************************************************************
+ *                                init_sched
+ *****************************************************************************/
+/**
+ * <Ring 0> Put every runnable proc at the top MLFQ level of the ready
+ * queues. Must be called after `proc_table' has been filled and before the
+ * first `restart'.
+ * 
+ *****************************************************************************/
+PUBLIC void init_sched()
+{
+	struct proc* p;
+
+	memset(&run_queue, 0, sizeof(run_queue));
+	memset(rq_links, 0, sizeof(rq_links));
+	memset(donations, 0, sizeof(donations));
+	memset(mlfq_level, 0, sizeof(mlfq_level));
+	boost_clock = 0;
+
+	for (p = &FIRST_PROC; p <= &LAST_PROC; p++) {
+		p->ticks = mlfq_quantum[0];
+		if (p->p_flags == 0)
+			rq_enqueue(p);
+	}
+}
 
 /*****************************************************************************
  *                                schedule
  *****************************************************************************/
 /**
  * <Ring 0> Choose one proc to run.
+ *
+ * A runnable proc which has used up the quantum of its MLFQ level drops one
+ * level and goes to the tail of the queue of its new level. Both the
+ * requeue and the pick cost O(1) regardless of NR_TASKS + NR_PROCS. If no
+ * proc is runnable at all, IDLE_PROC runs.
  * 
  *****************************************************************************/
 PUBLIC void schedule()
 {
-	struct proc*	p;
-	int		greatest_ticks = 0;
+	struct proc* p = p_proc_ready;
+	struct proc* prev = p_proc_ready;
 
-	while (!greatest_ticks) {
-		for (p = &FIRST_PROC; p <= &LAST_PROC; p++) {
-			if (p->p_flags == 0) {
-				if (p->ticks > greatest_ticks) {
-					greatest_ticks = p->ticks;
-					p_proc_ready = p;
-				}
-			}
+	disable_int();
+
+	if (p->p_flags == 0 && p->ticks == 0 && proc2pid(p) != IDLE_PROC) {
+		end_donation(p);
+		mlfq_demote(p);
+		rq_enqueue(p);
+	}
+
+	p = rq_pick();
+	p_proc_ready = p ? p : proc_table + IDLE_PROC;
+
+	/* still runnable, but someone else goes on */
+	if (p_proc_ready != prev && prev->p_flags == 0)
+		proc_stats[proc2pid(prev)].nivcsw++;
+	if (p_proc_ready != prev)
+		TRACE_EVENT(TR_SCHED, proc2pid(prev), proc2pid(p_proc_ready), 0);
+
+	enable_int();
+}
+
+/*****************************************************************************
+ *                                rq_enqueue
+ *****************************************************************************/
+/**
+ * <Ring 0> Append a proc to the tail of its ready queue, which is chosen by
+ * `priority' (its class: tasks above user procs) plus its MLFQ level.
+ * 
+ * @param p   The proc.
+ *****************************************************************************/
+PRIVATE void rq_enqueue(struct proc* p)
+{
+	struct run_queue* rq = &run_queue;
+	struct rq_link* l = &rq_links[proc2pid(p)];
+	int q = p->priority + (NR_MLFQ_LEVELS - 1) - mlfq_level[proc2pid(p)];
+
+	q = min(q, NR_SCHED_QUEUES - 1);
+	if (q < 0)
+		q = 0;
+
+	if (l->rq)
+		rq_dequeue(p);
+
+	l->rq = rq;
+	l->q = q;
+	l->next = 0;
+	l->prev = rq->tail[q];
+
+	if (rq->tail[q])
+		rq_links[proc2pid(rq->tail[q])].next = p;
+	else
+		rq->head[q] = p;
+	rq->tail[q] = p;
+
+	rq->bitmap |= 1 << q;
+}
+
+/*****************************************************************************
+ *                                rq_dequeue
+ *****************************************************************************/
+/**
+ * <Ring 0> Remove a proc from the run_queue it is in. Nothing happens if it
+ * is not queued.
+ * 
+ * @param p  The proc.
+ *****************************************************************************/
+PRIVATE void rq_dequeue(struct proc* p)
+{
+	struct rq_link* l = &rq_links[proc2pid(p)];
+	struct run_queue* rq = l->rq;
+
+	if (!rq)
+		return;
+
+	if (l->prev)
+		rq_links[proc2pid(l->prev)].next = l->next;
+	else
+		rq->head[l->q] = l->next;
+
+	if (l->next)
+		rq_links[proc2pid(l->next)].prev = l->prev;
+	else
+		rq->tail[l->q] = l->prev;
+
+	if (!rq->head[l->q])
+		rq->bitmap &= ~(1 << l->q);
+
+	l->rq = 0;
+	l->prev = l->next = 0;
+}
+
+/*****************************************************************************
+ *                                rq_pick
+ *****************************************************************************/
+/**
+ * <Ring 0> Find the first proc of the highest non-empty queue.
+ *
+ * A proc whose `p_flags' were changed behind the scheduler's back (e.g. by
+ * the Process Manager's `kill') is dropped here when it reaches the head.
+ * 
+ * @return The proc to run, or 0 if no proc is runnable.
+ *****************************************************************************/
+PRIVATE struct proc* rq_pick()
+{
+	struct proc* p;
+	int q;
+
+	while (run_queue.bitmap) {
+		__asm__ __volatile__("bsrl %1, %0" : "=r"(q) : "rm"(run_queue.bitmap));
+		p = run_queue.head[q];
+
+		if (p->p_flags != 0) {
+			rq_dequeue(p);
 		}
+		else if (p->ticks == 0) {
+			mlfq_demote(p);
+			rq_enqueue(p);
+		}
+		else {
+			return p;
+		}
+	}
+
+	return 0;
+}
+
+/*****************************************************************************
+ *                                mlfq_demote
+ *****************************************************************************/
+/**
+ * <Ring 0> A proc has used up its quantum: move it one level down (if it is
+ * not at the bottom yet) and give it the quantum of the new level. The
+ * caller requeues it.
+ * 
+ * @param p  The proc.
+ *****************************************************************************/
+PRIVATE void mlfq_demote(struct proc* p)
+{
+	int* level = &mlfq_level[proc2pid(p)];
+
+	if (*level < NR_MLFQ_LEVELS - 1)
+		(*level)++;
+	p->ticks = mlfq_quantum[*level];
+}
+
+/*****************************************************************************
+ *                                mlfq_promote
+ *****************************************************************************/
+/**
+ * <Ring 0> A proc is going to block in msg_receive() before using up its
+ * quantum, i.e. it waits for I/O or for a reply: move it one level up. It
+ * keeps its ticks; unblock() gives it a fresh quantum if it has none left.
+ * 
+ * @param p  The proc.
+ *****************************************************************************/
+PRIVATE void mlfq_promote(struct proc* p)
+{
+	int* level = &mlfq_level[proc2pid(p)];
+
+	if (*level > 0)
+		(*level)--;
+}
+
+/*****************************************************************************
+ *                                mlfq_boost
+ *****************************************************************************/
+/**
+ * <Ring 0> Move every proc back to the top level, so that procs pushed to
+ * the bottom by CPU hogs do not starve.
+ * 
+ *****************************************************************************/
+PRIVATE void mlfq_boost()
+{
+	struct proc* p;
+
+	for (p = &FIRST_PROC; p <= &LAST_PROC; p++) {
+		if (mlfq_level[proc2pid(p)] == 0)
+			continue;
+		mlfq_level[proc2pid(p)] = 0;
+		p->ticks = min(p->ticks, mlfq_quantum[0]);
+		if (rq_links[proc2pid(p)].rq)
+			rq_enqueue(p);
+	}
+}
+
+/*****************************************************************************
+ *                                sched_charge
+ *****************************************************************************/
+/**
+ * <Ring 0> Charge ticks a proc has run to it (`run_count' counts them all).
+ *
+ * A tick which interrupted the proc itself (k_reenter == 0) is its utime;
+ * one which interrupted the kernel, e.g. a syscall, is its stime.
+ *
+ * @attention Interrupts are left as they are: it is called from `restart'
+ * too, see clock_resync().
+ * 
+ * @param p         The proc.
+ * @param nr_ticks  How many ticks it has run.
+ *****************************************************************************/
+PUBLIC void sched_charge(struct proc* p, int nr_ticks)
+{
+	int used = min(nr_ticks, p->ticks);
+
+	p->ticks -= used;
+	p->run_count += nr_ticks;
+
+	if (k_reenter == 0)
+		proc_stats[proc2pid(p)].utime += nr_ticks;
+	else
+		proc_stats[proc2pid(p)].stime += nr_ticks;
+}
 
-		if (!greatest_ticks)
-			for (p = &FIRST_PROC; p <= &LAST_PROC; p++)
-				if (p->p_flags == 0)
-					p->ticks = p->priority;
+/*****************************************************************************
+ *                                sched_clock
+ *****************************************************************************/
+/**
+ * <Ring 0> Clock ticks have gone by: boost all procs every MLFQ_BOOST_TICKS.
+ * Who ran in them is charged by sched_charge().
+ * 
+ * @param nr_ticks  How many ticks since the last call.
+ *****************************************************************************/
+PUBLIC void sched_clock(int nr_ticks)
+{
+	sched_now += nr_ticks;
+
+	boost_clock += nr_ticks;
+	if (boost_clock >= MLFQ_BOOST_TICKS) {
+		boost_clock = 0;
+		disable_int();
+		mlfq_boost();
+		enable_int();
 	}
 }
 
+/*****************************************************************************
+ *                                idle
+ *****************************************************************************/
+/**
+ * <Ring 1> The main loop of IDLE_PROC: trap into the kernel to halt, over
+ * and over again. Instructions like `hlt' need Ring 0.
+ * 
+ *****************************************************************************/
+PUBLIC void idle()
+{
+	MESSAGE msg;
+
+	while (1)
+		sendrec(IDLE, ANY, &msg);
+}
+
+/*****************************************************************************
+ *                                idle_halt
+ *****************************************************************************/
+/**
+ * <Ring 0> Halt until an interrupt comes, unless some proc got runnable in
+ * the meantime, then switch to whoever is runnable now.
+ *
+ * Interrupts are enabled in here (see sys_call), so an interrupt handler
+ * may wake a proc up right after we have seen the queues empty. Hence the
+ * check is made with interrupts off, and `sti' is followed immediately by
+ * `hlt': the interrupt can not be taken before the CPU halts, and it still
+ * wakes the CPU up.
+ * 
+ *****************************************************************************/
+PRIVATE void idle_halt()
+{
+	struct proc* p;
+
+	disable_int();
+	p = rq_pick();
+	if (!p) {
+		__asm__ __volatile__("sti\n\thlt\n\tcli");
+		p = rq_pick();
+	}
+	if (p)
+		p_proc_ready = p;
+	enable_int();
+}
+
 /*****************************************************************************
  *                                sys_sendrec
  *****************************************************************************/
 /**
  * <Ring 0> The core routine of system call `sendrec()'.
  * 
- * @param function SEND or RECEIVE
+ * @param function SEND, RECEIVE, BOTH, SENDA, NOTIFY, YIELD, or IDLE
+ *                 (IDLE_PROC only)
  * @param src_dest To/From whom the message is transferred.
  * @param m        Ptr to the MESSAGE body.
  * @param p        The caller proc.
@@ -80,24 +440,61 @@ PUBLIC int sys_sendrec(int function, int src_dest, MESSAGE* m, struct proc* p)
 	assert(mla->source != src_dest);
 
 	/**
-	 * Actually we have the third message type: BOTH. However, it is not
-	 * allowed to be passed to the kernel directly. Kernel doesn't know
-	 * it at all. It is transformed into a SEND followed by a RECEIVE
-	 * by `send_recv()'.
+	 * BOTH is a SEND followed by a RECEIVE from the same proc, done in
+	 * one trap. If the SEND can not complete now, the caller is blocked
+	 * in SENDING and its RECEIVE is armed by msg_receive() of dest when
+	 * dest takes the message.
 	 */
-	if (function == SEND) {
+	if (function == BOTH) {
+		assert(src_dest >= 0 && src_dest < NR_TASKS + NR_PROCS);
+		ret = msg_send(p, src_dest, m);
+		if (ret != 0)
+			return ret;
+		if (p->p_flags & SENDING) {
+			reply_pending[caller] = 1;
+		}
+		else {
+			awaiting_reply[caller] = 1;
+			ret = msg_receive(p, src_dest, m);
+		}
+		if (ret != 0)
+			return ret;
+	}
+	else if (function == SEND) {
 		ret = msg_send(p, src_dest, m);
 		if (ret != 0)
 			return ret;
 	}
 	else if (function == RECEIVE) {
+		awaiting_reply[caller] = 0;
 		ret = msg_receive(p, src_dest, m);
 		if (ret != 0)
 			return ret;
 	}
+	else if (function == SENDA) {
+		ret = msg_senda(p, src_dest, m);
+		if (ret != 0)
+			return ret;
+	}
+	else if (function == NOTIFY) {
+		ret = msg_notify(p, src_dest);
+		if (ret != 0)
+			return ret;
+	}
+	else if (function == IDLE) {
+		assert(caller == IDLE_PROC);
+		idle_halt();
+	}
+	else if (function == YIELD) {
+		disable_int();
+		rq_enqueue(p);	/* to the tail, same level */
+		enable_int();
+		schedule();
+	}
 	else {
 		panic("{sys_sendrec} invalid function: "
-		      "%d (SEND:%d, RECEIVE:%d).", function, SEND, RECEIVE);
+		      "%d (SEND:%d, RECEIVE:%d, BOTH:%d, SENDA:%d, NOTIFY:%d).",
+		      function, SEND, RECEIVE, BOTH, SENDA, NOTIFY);
 	}
 
 	return 0;
@@ -112,11 +509,14 @@ PUBLIC int sys_sendrec(int function, int src_dest, MESSAGE* m, struct proc* p)
  * It is an encapsulation of `sendrec',
  * invoking `sendrec' directly should be avoided
  *
- * @param function  SEND, RECEIVE or BOTH
+ * @param function  SEND, RECEIVE, BOTH, SENDA or NOTIFY
  * @param src_dest  The caller's proc_nr
  * @param msg       Pointer to the MESSAGE struct
  * 
- * @return always 0.
+ * @return Zero if success. SENDA returns E_MAILBOX_FULL if dest's mailbox
+ *         has no room, SEND and BOTH return E_DEADLOCK if blocking would
+ *         close a wait-for cycle (a task panics instead). In both cases
+ *         nothing is sent.
  *****************************************************************************/
 PUBLIC int send_recv(int function, int src_dest, MESSAGE* msg)
 {
@@ -127,23 +527,81 @@ PUBLIC int send_recv(int function, int src_dest, MESSAGE* msg)
 
 	switch (function) {
 	case BOTH:
-		ret = sendrec(SEND, src_dest, msg);
-		if (ret == 0)
-			ret = sendrec(RECEIVE, src_dest, msg);
-		break;
 	case SEND:
 	case RECEIVE:
+	case SENDA:
+	case NOTIFY:
 		ret = sendrec(function, src_dest, msg);
 		break;
 	default:
 		assert((function == BOTH) ||
-		       (function == SEND) || (function == RECEIVE));
+		       (function == SEND) || (function == RECEIVE) ||
+		       (function == SENDA) || (function == NOTIFY));
 		break;
 	}
 
+#ifdef DEADLOCK_CHECK
+	/**
+	 * The kernel has printed the cycle. A task can not go on, a user
+	 * proc gets the error back. msg->source is the caller here.
+	 */
+	if (ret == E_DEADLOCK && msg->source < NR_TASKS)
+		panic("deadlock, function: %d, src_dest: %d", function, src_dest);
+#endif
+
 	return ret;
 }
 
+/*****************************************************************************
+ *                                yield
+ *****************************************************************************/
+/**
+ * <Ring 1~3> Give the CPU to the next proc at the same level, if any.
+ * 
+ *****************************************************************************/
+PUBLIC void yield()
+{
+	MESSAGE msg;
+
+	sendrec(YIELD, ANY, &msg);
+}
+
+/*****************************************************************************
+ *                                has_senders
+ *****************************************************************************/
+/**
+ * <Ring 0~1> Tell whether anyone is blocked sending a message to a proc,
+ * i.e. whether its next RECEIVE from ANY would return at once with a SEND.
+ * 
+ * @param dest  The proc.
+ * 
+ * @return Non-zero if so.
+ *****************************************************************************/
+PUBLIC int has_senders(int dest)
+{
+	return proc_table[dest].q_sending != 0;
+}
+
+/*****************************************************************************
+ *                                awaits_from
+ *****************************************************************************/
+/**
+ * <Ring 0~1> Tell whether a proc is blocked receiving from a certain proc,
+ * as one which has done BOTH is once its message is taken. A SEND to it
+ * from src then does not block.
+ * 
+ * @param pid  The proc.
+ * @param src  From whom.
+ * 
+ * @return Non-zero if so.
+ *****************************************************************************/
+PUBLIC int awaits_from(int pid, int src)
+{
+	struct proc * p = &proc_table[pid];
+
+	return (p->p_flags & RECEIVING) && p->p_recvfrom == src;
+}
+
 /*****************************************************************************
  *				  ldt_seg_linear
  *****************************************************************************/
@@ -201,12 +659,171 @@ PUBLIC void reset_msg(MESSAGE* p)
 	memset(p, 0, sizeof(MESSAGE));
 }
 
+/*****************************************************************************
+ *                                grant_alloc
+ *****************************************************************************/
+/**
+ * <Ring 0~1> Register a memory region which another proc may access.
+ *
+ * @attention The caller must make sure `owner' is really the owner of the
+ * region. User procs go through TASK_SYS (GRANT_CREATE) for this.
+ * 
+ * @param owner    Proc nr of the owner.
+ * @param grantee  Who may use the grant, ANY for anyone.
+ * @param la       Linear address of the region.
+ * @param len      Length in bytes.
+ * @param rights   GRANT_READ and/or GRANT_WRITE.
+ * 
+ * @return The grant id, GRANT_INVALID if no free slot.
+ *****************************************************************************/
+PUBLIC int grant_alloc(int owner, int grantee, void* la, int len, int rights)
+{
+	int i;
+	int id = GRANT_INVALID;
+
+	if (!(rights & (GRANT_READ | GRANT_WRITE)) || len < 0)
+		return id;
+
+	disable_int();
+	for (i = 0; i < NR_GRANTS; i++) {
+		struct grant* g = &grants[i];
+		if (g->rights == 0) {
+			g->owner = owner;
+			g->grantee = grantee;
+			g->base = (u32)la;
+			g->len = len;
+			g->rights = rights;
+			id = GRANT_ID(i, g->gen);
+			break;
+		}
+	}
+	enable_int();
+
+	return id;
+}
+
+/*****************************************************************************
+ *                                grant_free
+ *****************************************************************************/
+/**
+ * <Ring 0~1> Revoke a grant.
+ * 
+ * @param owner  Who asks. Only the owner may revoke a grant.
+ * @param id     The grant id.
+ * 
+ * @return Zero if success.
+ *****************************************************************************/
+PUBLIC int grant_free(int owner, int id)
+{
+	int ret = -1;
+	struct grant* g = &grants[GRANT_SLOT(id)];
+
+	if (id < 0 || GRANT_SLOT(id) >= NR_GRANTS)
+		return ret;
+
+	disable_int();
+	if (g->rights && GRANT_ID(GRANT_SLOT(id), g->gen) == id &&
+	    g->owner == owner) {
+		g->rights = 0;
+		g->gen++;
+		ret = 0;
+	}
+	enable_int();
+
+	return ret;
+}
+
+/*****************************************************************************
+ *                                grant_la
+ *****************************************************************************/
+/**
+ * <Ring 0~1> Check an access to a granted region and translate it.
+ * 
+ * @param grantee  Who wants to access the region.
+ * @param id       The grant id, usually taken from a MESSAGE.
+ * @param offset   Offset in the region.
+ * @param len      How many bytes.
+ * @param rights   GRANT_READ and/or GRANT_WRITE.
+ * 
+ * @return The linear address of (region + offset), or 0 if the grant is
+ *         not valid for this access.
+ *****************************************************************************/
+PUBLIC void* grant_la(int grantee, int id, int offset, int len, int rights)
+{
+	struct grant* g = &grants[GRANT_SLOT(id)];
+
+	if (id < 0 || GRANT_SLOT(id) >= NR_GRANTS)
+		return 0;
+
+	if (g->rights == 0 || GRANT_ID(GRANT_SLOT(id), g->gen) != id)
+		return 0;
+	if (g->grantee != ANY && g->grantee != grantee)
+		return 0;
+	if ((g->rights & rights) != rights)
+		return 0;
+	if (offset < 0 || len < 0 || offset + len > g->len)
+		return 0;
+
+	return (void*)(g->base + offset);
+}
+
+/*****************************************************************************
+ *                                safecopy_from
+ *****************************************************************************/
+/**
+ * <Ring 0~1> Copy from a granted region.
+ * 
+ * @param grantee  Who copies.
+ * @param id       The grant id.
+ * @param offset   Offset in the region.
+ * @param dst      Linear address of the destination.
+ * @param len      How many bytes.
+ * 
+ * @return Zero if success.
+ *****************************************************************************/
+PUBLIC int safecopy_from(int grantee, int id, int offset, void* dst, int len)
+{
+	void* la = grant_la(grantee, id, offset, len, GRANT_READ);
+
+	if (!la)
+		return -1;
+
+	phys_copy(dst, la, len);
+	return 0;
+}
+
+/*****************************************************************************
+ *                                safecopy_to
+ *****************************************************************************/
+/**
+ * <Ring 0~1> Copy into a granted region.
+ * 
+ * @param grantee  Who copies.
+ * @param id       The grant id.
+ * @param offset   Offset in the region.
+ * @param src      Linear address of the source.
+ * @param len      How many bytes.
+ * 
+ * @return Zero if success.
+ *****************************************************************************/
+PUBLIC int safecopy_to(int grantee, int id, int offset, void* src, int len)
+{
+	void* la = grant_la(grantee, id, offset, len, GRANT_WRITE);
+
+	if (!la)
+		return -1;
+
+	phys_copy(la, src, len);
+	return 0;
+}
+
 /*****************************************************************************
  *                                block
  *****************************************************************************/
 /**
  * <Ring 0> This routine is called after `p_flags' has been set (!= 0), it
- * calls `schedule()' to choose another proc as the `proc_ready'.
+ * takes the proc off the ready queues and calls `schedule()' to choose
+ * another proc as the `proc_ready'.
  *
  * @attention This routine does not change `p_flags'. Make sure the `p_flags'
  * of the proc to be blocked has been set properly.
@@ -216,6 +833,14 @@ PUBLIC void reset_msg(MESSAGE* p)
 PRIVATE void block(struct proc* p)
 {
 	assert(p->p_flags);
+
+	disable_int();
+	rq_dequeue(p);
+	drop_donation(p);
+	account_wait(p);
+	proc_stats[proc2pid(p)].nvcsw++;
+	enable_int();
+
 	schedule();
 }
 
@@ -223,56 +848,268 @@ PRIVATE void block(struct proc* p)
  *                                unblock
  *****************************************************************************/
 /**
- * <Ring 0> This is a dummy routine. It does nothing actually. When it is
- * called, the `p_flags' should have been cleared (== 0).
+ * <Ring 0> Put the proc back into the ready queues. When it is called, the
+ * `p_flags' should have been cleared (== 0).
+ *
+ * If it lands in a queue above the running proc's (e.g. a task woken by
+ * inform_int() while a user proc hogs the CPU), it runs at once instead
+ * of waiting for the running proc's quantum to end.
  * 
  * @param p The unblocked proc.
  *****************************************************************************/
 PRIVATE void unblock(struct proc* p)
 {
+	struct proc* cur = p_proc_ready;
+
 	assert(p->p_flags == 0);
+
+	disable_int();
+	account_wait(p);
+	if (p->ticks == 0)
+		p->ticks = mlfq_quantum[mlfq_level[proc2pid(p)]];
+	rq_enqueue(p);
+
+	if (cur == proc_table + IDLE_PROC ||
+	    (cur->p_flags == 0 && rq_links[proc2pid(cur)].rq &&
+	     rq_links[proc2pid(p)].q > rq_links[proc2pid(cur)].q)) {
+		if (cur != proc_table + IDLE_PROC)
+			proc_stats[proc2pid(cur)].nivcsw++;
+		TRACE_EVENT(TR_SCHED, proc2pid(cur), proc2pid(p), 0);
+		p_proc_ready = p;
+	}
+	enable_int();
+}
+
+/*****************************************************************************
+ *                                account_wait
+ *****************************************************************************/
+/**
+ * <Ring 0> Charge the time a proc has been blocked so far to SENDING or
+ * RECEIVING, whichever it was blocked in, and start over with its current
+ * `p_flags'. Called whenever they change between blocked states.
+ * 
+ * @param p  The proc.
+ *****************************************************************************/
+PRIVATE void account_wait(struct proc* p)
+{
+	int pid = proc2pid(p);
+	int t = sched_now - wait_since[pid];
+
+	if (wait_flags[pid] & SENDING)
+		proc_stats[pid].sending_ticks += t;
+	else if (wait_flags[pid] & RECEIVING)
+		proc_stats[pid].receiving_ticks += t;
+
+	wait_flags[pid] = p->p_flags;
+	wait_since[pid] = sched_now;
+}
+
+/*****************************************************************************
+ *                                note_sent
+ *****************************************************************************/
+/**
+ * <Ring 0> Account and trace a MESSAGE sent.
+ * 
+ * @param src   The sender.
+ * @param dest  To whom.
+ * @param type  The MESSAGE type.
+ *****************************************************************************/
+PRIVATE void note_sent(int src, int dest, int type)
+{
+	proc_stats[src].nr_sent++;
+	TRACE_EVENT(TR_SEND, src, dest, type);
+}
+
+/*****************************************************************************
+ *                                note_received
+ *****************************************************************************/
+/**
+ * <Ring 0> Account and trace a MESSAGE received.
+ * 
+ * @param pid   The receiver.
+ * @param src   From whom, INTERRUPT for HARD_INT.
+ * @param type  The MESSAGE type.
+ *****************************************************************************/
+PRIVATE void note_received(int pid, int src, int type)
+{
+	proc_stats[pid].nr_received++;
+	TRACE_EVENT(TR_RECV, pid, src, type);
+}
+
+/*****************************************************************************
+ *                                handoff
+ *****************************************************************************/
+/**
+ * <Ring 0> Like block(), but instead of asking `schedule()' for the next
+ * proc, switch straight to the partner of a rendezvous and lend it the rest
+ * of the blocked proc's ticks.
+ *
+ * @attention As with block(), `p_flags' of `from' must have been set.
+ * 
+ * @param from  The proc to be blocked, the lender.
+ * @param to    The runnable partner, the borrower.
+ *****************************************************************************/
+PRIVATE void handoff(struct proc* from, struct proc* to)
+{
+	struct donation* d = &donations[proc2pid(to)];
+
+	assert(from->p_flags);
+	assert(to->p_flags == 0);
+
+	disable_int();
+
+	rq_dequeue(from);
+	drop_donation(from);
+	account_wait(from);
+	proc_stats[proc2pid(from)].nvcsw++;
+
+	if (!d->from && from->ticks) { /* no nested lending */
+		d->from = from;
+		d->ticks = from->ticks;
+		to->ticks += from->ticks;
+		d->base = to->ticks;
+		from->ticks = 0;
+	}
+
+	p_proc_ready = to;
+
+	enable_int();
+}
+
+/*****************************************************************************
+ *                                end_donation
+ *****************************************************************************/
+/**
+ * <Ring 0> Give the lent ticks which have not been used back to the lender.
+ * 
+ * @param p  The borrower.
+ *****************************************************************************/
+PRIVATE void end_donation(struct proc* p)
+{
+	struct donation* d = &donations[proc2pid(p)];
+
+	if (!d->from)
+		return;
+
+	int left = d->ticks - (d->base - p->ticks);
+	if (left > 0) {
+		p->ticks -= left;
+		d->from->ticks += left;
+	}
+
+	d->from = 0;
+}
+
+/*****************************************************************************
+ *                                drop_donation
+ *****************************************************************************/
+/**
+ * <Ring 0> A borrower is blocking. Unless it waits for its lender (who is
+ * waiting for it), the lent ticks would be stuck with it: give them back.
+ *
+ * @attention `p_flags' of p must have been set.
+ * 
+ * @param p  The proc to be blocked.
+ *****************************************************************************/
+PRIVATE void drop_donation(struct proc* p)
+{
+	struct donation* d = &donations[proc2pid(p)];
+	int partner = (p->p_flags & SENDING) ? p->p_sendto : p->p_recvfrom;
+
+	if (d->from && partner != proc2pid(d->from))
+		end_donation(p);
+}
+
+/*****************************************************************************
+ *                                waits_for
+ *****************************************************************************/
+#ifdef DEADLOCK_CHECK
+/**
+ * <Ring 0> Follow a wait-for edge: a SENDING proc waits for `p_sendto', a
+ * proc RECEIVING from a certain proc waits for `p_recvfrom'.
+ * 
+ * @param p  The proc.
+ * 
+ * @return The proc nr p waits for, -1 if none.
+ *****************************************************************************/
+PRIVATE int waits_for(struct proc* p)
+{
+	if (p->p_flags & SENDING)
+		return p->p_sendto;
+	if ((p->p_flags & RECEIVING) &&
+	    p->p_recvfrom >= 0 && p->p_recvfrom < NR_TASKS + NR_PROCS)
+		return p->p_recvfrom;
+	return -1;
 }
 
 /*****************************************************************************
  *                                deadlock
  *****************************************************************************/
 /**
- * <Ring 0> Check whether it is safe to send a message from src to dest.
- * The routine will detect if the messaging graph contains a cycle. For
- * instance, if we have procs trying to send messages like this:
- * A -> B -> C -> A, then a deadlock occurs, because all of them will
- * wait forever. If no cycles detected, it is considered as safe.
+ * <Ring 0> Check whether it is safe for src to block sending a message to
+ * dest. The wait-for edges are kept up to date by IPC itself (see
+ * waits_for()). The routine follows them from dest; if they lead back to
+ * src, e.g. A -> B -> C -> A, all of them would wait forever, and the
+ * cycle is printed.
+ *
+ * It is only called when src is really going to block, so a SEND to a proc
+ * who is already waiting for it costs nothing.
  * 
  * @param src   Who wants to send message.
  * @param dest  To whom the message is sent.
  * 
- * @return Zero if success.
+ * @return Zero if safe.
  *****************************************************************************/
 PRIVATE int deadlock(int src, int dest)
 {
-	struct proc* p = proc_table + dest;
-	while (1) {
-		if (p->p_flags & SENDING) {
-			if (p->p_sendto == src) {
-				/* print the chain */
-				p = proc_table + dest;
-				printl("=_=%s", p->name);
-				do {
-					assert(p->p_msg);
-					p = proc_table + p->p_sendto;
-					printl("->%s", p->name);
-				} while (p != proc_table + src);
-				printl("=_=");
-
-				return 1;
-			}
-			p = proc_table + p->p_sendto;
-		}
-		else {
-			break;
-		}
+	int p = dest;
+	int n;
+
+	/* bounded: the edges may go round a cycle src is not in */
+	for (n = 0; p != src; n++) {
+		if (p < 0 || n == NR_TASKS + NR_PROCS)
+			return 0;
+		p = waits_for(proc_table + p);
 	}
-	return 0;
+
+	/* print the chain */
+	printl("=_=%s", proc_table[src].name);
+	for (p = dest; p != src; p = waits_for(proc_table + p))
+		printl("->%s", proc_table[p].name);
+	printl("->%s=_=\n", proc_table[src].name);
+
+	return 1;
+}
+#endif
+
+/*****************************************************************************
+ *                                unlink_sender
+ *****************************************************************************/
+/**
+ * <Ring 0> Remove a proc from the sending queue of another proc in O(1).
+ * 
+ * @param dest    Whose sending queue.
+ * @param sender  The proc to be removed, must be in dest's sending queue.
+ *****************************************************************************/
+PRIVATE void unlink_sender(struct proc* dest, struct proc* sender)
+{
+	struct proc* prev = prev_sending[proc2pid(sender)];
+	struct proc* next = sender->next_sending;
+
+	assert(dest->q_sending);
+
+	if (prev)
+		prev->next_sending = next;
+	else
+		dest->q_sending = next;
+
+	if (next)
+		prev_sending[proc2pid(next)] = prev;
+	else
+		q_sending_tail[proc2pid(dest)] = prev;
+
+	sender->next_sending = 0;
+	prev_sending[proc2pid(sender)] = 0;
 }
 
 /*****************************************************************************
@@ -293,14 +1130,10 @@ PRIVATE int msg_send(struct proc* current, int dest, MESSAGE* m)
 {
 	struct proc* sender = current;
 	struct proc* p_dest = proc_table + dest; /* proc dest */
+	MESSAGE* mla = (MESSAGE*)va2la(proc2pid(sender), m);
 
 	assert(proc2pid(sender) != dest);
 
-	/* check for deadlock here */
-	if (deadlock(proc2pid(sender), dest)) {
-		panic(">>DEADLOCK<< %s->%s", sender->name, p_dest->name);
-	}
-
 	if ((p_dest->p_flags & RECEIVING) && /* dest is waiting for the msg */
 	    (p_dest->p_recvfrom == proc2pid(sender) ||
 	     p_dest->p_recvfrom == ANY)) {
@@ -313,8 +1146,26 @@ PRIVATE int msg_send(struct proc* current, int dest, MESSAGE* m)
 		p_dest->p_msg = 0;
 		p_dest->p_flags &= ~RECEIVING; /* dest has received the msg */
 		p_dest->p_recvfrom = NO_TASK;
+		awaiting_reply[dest] = 0;
+		note_sent(proc2pid(sender), dest, mla->type);
+		note_received(dest, proc2pid(sender), mla->type);
+
+		/* a reply to the proc who lent us its ticks: return them and
+		 * let it run at once
+		 */
+		int reply = (donations[proc2pid(sender)].from == p_dest);
+		if (reply)
+			end_donation(sender);
+
 		unblock(p_dest);
 
+		if (reply && p_proc_ready != p_dest) {
+			/* still runnable, but the lender goes on */
+			proc_stats[proc2pid(sender)].nivcsw++;
+			TRACE_EVENT(TR_SCHED, proc2pid(sender), dest, 0);
+			p_proc_ready = p_dest;
+		}
+
 		assert(p_dest->p_flags == 0);
 		assert(p_dest->p_msg == 0);
 		assert(p_dest->p_recvfrom == NO_TASK);
@@ -325,23 +1176,29 @@ PRIVATE int msg_send(struct proc* current, int dest, MESSAGE* m)
 		assert(sender->p_sendto == NO_TASK);
 	}
 	else { /* dest is not waiting for the msg */
+#ifdef DEADLOCK_CHECK
+		if (deadlock(proc2pid(sender), dest))
+			return E_DEADLOCK;
+#endif
+
 		sender->p_flags |= SENDING;
 		assert(sender->p_flags == SENDING);
 		sender->p_sendto = dest;
 		sender->p_msg = m;
+		note_sent(proc2pid(sender), dest, mla->type);
 
 		/* append to the sending queue */
-		struct proc * p;
-		if (p_dest->q_sending) {
-			p = p_dest->q_sending;
-			while (p->next_sending)
-				p = p->next_sending;
-			p->next_sending = sender;
+		struct proc * tail = q_sending_tail[dest];
+		if (tail) {
+			assert(p_dest->q_sending);
+			tail->next_sending = sender;
 		}
 		else {
 			p_dest->q_sending = sender;
 		}
+		prev_sending[proc2pid(sender)] = tail;
 		sender->next_sending = 0;
+		q_sending_tail[dest] = sender;
 
 		block(sender);
 
@@ -378,7 +1235,6 @@ PRIVATE int msg_receive(struct proc* current, int src, MESSAGE* m)
 						  * it.
 						  */
 	struct proc* p_from = 0; /* from which the message will be fetched */
-	struct proc* prev = 0;
 	int copyok = 0;
 
 	assert(proc2pid(p_who_wanna_recv) != src);
@@ -398,6 +1254,7 @@ PRIVATE int msg_receive(struct proc* current, int src, MESSAGE* m)
 			  sizeof(MESSAGE));
 
 		p_who_wanna_recv->has_int_msg = 0;
+		note_received(proc2pid(p_who_wanna_recv), INTERRUPT, HARD_INT);
 
 		assert(p_who_wanna_recv->p_flags == 0);
 		assert(p_who_wanna_recv->p_msg == 0);
@@ -408,7 +1265,19 @@ PRIVATE int msg_receive(struct proc* current, int src, MESSAGE* m)
 	}
 
 
-	/* Arrives here if no interrupt for p_who_wanna_recv. */
+	/* Arrives here if no interrupt for p_who_wanna_recv. Pending
+	 * notifications and mailbox MESSAGEs come before blocked senders,
+	 * unless a reply is awaited.
+	 */
+	if (src != INTERRUPT && !awaiting_reply[proc2pid(p_who_wanna_recv)] &&
+	    fetch_async(p_who_wanna_recv, src, m)) {
+		assert(p_who_wanna_recv->p_flags == 0);
+		assert(p_who_wanna_recv->p_msg == 0);
+		assert(p_who_wanna_recv->p_sendto == NO_TASK);
+
+		return 0;
+	}
+
 	if (src == ANY) {
 		/* p_who_wanna_recv is ready to receive messages from
 		 * ANY proc, we'll check the sending queue and pick the
@@ -442,20 +1311,6 @@ PRIVATE int msg_receive(struct proc* current, int src, MESSAGE* m)
 			 */
 			copyok = 1;
 
-			struct proc* p = p_who_wanna_recv->q_sending;
-			assert(p); /* p_from must have been appended to the
-				    * queue, so the queue must not be NULL
-				    */
-			while (p) {
-				assert(p_from->p_flags & SENDING);
-				if (proc2pid(p) == src) { /* if p is the one */
-					p_from = p;
-					break;
-				}
-				prev = p;
-				p = p->next_sending;
-			}
-
 			assert(p_who_wanna_recv->p_flags == 0);
 			assert(p_who_wanna_recv->p_msg == 0);
 			assert(p_who_wanna_recv->p_recvfrom == NO_TASK);
@@ -474,16 +1329,8 @@ PRIVATE int msg_receive(struct proc* current, int src, MESSAGE* m)
 		 * waiting for this moment in the queue, so we should
 		 * remove it from the queue.
 		 */
-		if (p_from == p_who_wanna_recv->q_sending) { /* the 1st one */
-			assert(prev == 0);
-			p_who_wanna_recv->q_sending = p_from->next_sending;
-			p_from->next_sending = 0;
-		}
-		else {
-			assert(prev);
-			prev->next_sending = p_from->next_sending;
-			p_from->next_sending = 0;
-		}
+		unlink_sender(p_who_wanna_recv, p_from);
+		awaiting_reply[proc2pid(p_who_wanna_recv)] = 0;
 
 		assert(m);
 		assert(p_from->p_msg);
@@ -491,11 +1338,26 @@ PRIVATE int msg_receive(struct proc* current, int src, MESSAGE* m)
 		phys_copy(va2la(proc2pid(p_who_wanna_recv), m),
 			  va2la(proc2pid(p_from), p_from->p_msg),
 			  sizeof(MESSAGE));
+		note_received(proc2pid(p_who_wanna_recv), proc2pid(p_from),
+			      ((MESSAGE*)va2la(proc2pid(p_who_wanna_recv), m))->type);
 
+		MESSAGE* reply = p_from->p_msg;
 		p_from->p_msg = 0;
 		p_from->p_sendto = NO_TASK;
 		p_from->p_flags &= ~SENDING;
-		unblock(p_from);
+
+		if (reply_pending[proc2pid(p_from)]) {
+			/* p_from did BOTH, now it waits for our reply */
+			reply_pending[proc2pid(p_from)] = 0;
+			awaiting_reply[proc2pid(p_from)] = 1;
+			p_from->p_flags |= RECEIVING;
+			p_from->p_msg = reply;
+			p_from->p_recvfrom = proc2pid(p_who_wanna_recv);
+			account_wait(p_from);
+		}
+		else {
+			unblock(p_from);
+		}
 	}
 	else {  /* nobody's sending any msg */
 		/* Set p_flags so that p_who_wanna_recv will not
@@ -510,7 +1372,15 @@ PRIVATE int msg_receive(struct proc* current, int src, MESSAGE* m)
 		else
 			p_who_wanna_recv->p_recvfrom = proc2pid(p_from);
 
-		block(p_who_wanna_recv);
+		mlfq_promote(p_who_wanna_recv);
+
+		/* If we are waiting for a certain proc who is runnable (e.g.
+		 * the server we have just sent a request to), run it now.
+		 */
+		if (src != ANY && src != INTERRUPT && p_from->p_flags == 0)
+			handoff(p_who_wanna_recv, p_from);
+		else
+			block(p_who_wanna_recv);
 
 		assert(p_who_wanna_recv->p_flags == RECEIVING);
 		assert(p_who_wanna_recv->p_msg != 0);
@@ -522,6 +1392,183 @@ PRIVATE int msg_receive(struct proc* current, int src, MESSAGE* m)
 	return 0;
 }
 
+/*****************************************************************************
+ *                                msg_senda
+ *****************************************************************************/
+/**
+ * <Ring 0> Send a message to the dest proc without blocking. If dest is
+ * waiting for the message it is delivered at once, just like msg_send().
+ * Otherwise the message is put into dest's mailbox and will be picked up by
+ * dest's next RECEIVE. A dest waiting for the reply of BOTH is not waiting
+ * for it.
+ * 
+ * @param current  The caller, the sender.
+ * @param dest     To whom the message is sent.
+ * @param m        The message.
+ * 
+ * @return Zero if success, E_MAILBOX_FULL if dest's mailbox is full.
+ *****************************************************************************/
+PRIVATE int msg_senda(struct proc* current, int dest, MESSAGE* m)
+{
+	struct proc* sender = current;
+	struct proc* p_dest = proc_table + dest;
+	struct mailbox* mb = &mailboxes[dest];
+	MESSAGE* mla = (MESSAGE*)va2la(proc2pid(sender), m);
+
+	assert(proc2pid(sender) != dest);
+	assert(m);
+
+	if ((p_dest->p_flags & RECEIVING) && /* dest is waiting for the msg */
+	    !awaiting_reply[dest] &&	     /* ... and not for a reply */
+	    (p_dest->p_recvfrom == proc2pid(sender) ||
+	     p_dest->p_recvfrom == ANY)) {
+		assert(p_dest->p_msg);
+
+		phys_copy(va2la(dest, p_dest->p_msg),
+			  va2la(proc2pid(sender), m),
+			  sizeof(MESSAGE));
+		p_dest->p_msg = 0;
+		p_dest->p_flags &= ~RECEIVING; /* dest has received the msg */
+		p_dest->p_recvfrom = NO_TASK;
+		note_sent(proc2pid(sender), dest, mla->type);
+		note_received(dest, proc2pid(sender), mla->type);
+		unblock(p_dest);
+
+		return 0;
+	}
+
+	if (mb->count == NR_MAILBOX_MSGS)
+		return E_MAILBOX_FULL;
+
+	phys_copy(&mb->msg[(mb->head + mb->count) % NR_MAILBOX_MSGS],
+		  va2la(proc2pid(sender), m),
+		  sizeof(MESSAGE));
+	mb->count++;
+	note_sent(proc2pid(sender), dest, mla->type);
+
+	return 0;
+}
+
+/*****************************************************************************
+ *                                msg_notify
+ *****************************************************************************/
+/**
+ * <Ring 0> Notify the dest proc without blocking. If dest is waiting for a
+ * message from the caller (or ANY), it gets a NOTIFY_MSG at once; otherwise
+ * a pending bit is set and the NOTIFY_MSG is generated by dest's next
+ * RECEIVE (not by the reply half of BOTH). Notifying a proc which already
+ * has the bit set does nothing.
+ * 
+ * @param current  The caller, the notifier.
+ * @param dest     Who is to be notified.
+ * 
+ * @return Zero if success.
+ *****************************************************************************/
+PRIVATE int msg_notify(struct proc* current, int dest)
+{
+	int src = proc2pid(current);
+	struct proc* p_dest = proc_table + dest;
+
+	assert(src != dest);
+
+	if ((p_dest->p_flags & RECEIVING) && /* dest is waiting for the msg */
+	    !awaiting_reply[dest] &&	     /* ... and not for a reply */
+	    (p_dest->p_recvfrom == src || p_dest->p_recvfrom == ANY)) {
+		MESSAGE msg;
+		reset_msg(&msg);
+		msg.source = src;
+		msg.type = NOTIFY_MSG;
+
+		assert(p_dest->p_msg);
+		phys_copy(va2la(dest, p_dest->p_msg), &msg, sizeof(MESSAGE));
+		p_dest->p_msg = 0;
+		p_dest->p_flags &= ~RECEIVING; /* dest has received the msg */
+		p_dest->p_recvfrom = NO_TASK;
+		note_received(dest, src, NOTIFY_MSG);
+		unblock(p_dest);
+	}
+	else {
+		notify_bits[dest][src / 32] |= 1 << (src % 32);
+	}
+	note_sent(src, dest, NOTIFY_MSG);
+
+	return 0;
+}
+
+/*****************************************************************************
+ *                                fetch_async
+ *****************************************************************************/
+/**
+ * <Ring 0> Hand a pending notification or a mailbox MESSAGE to a proc who
+ * is doing RECEIVE. Notifications go first.
+ * 
+ * @param p    The receiver.
+ * @param src  ANY or a proc nr.
+ * @param m    Where the MESSAGE is to be put (in p's address space).
+ * 
+ * @return 1 if a MESSAGE has been copied to m, 0 if nothing is pending.
+ *****************************************************************************/
+PRIVATE int fetch_async(struct proc* p, int src, MESSAGE* m)
+{
+	int pid = proc2pid(p);
+	u32* bits = notify_bits[pid];
+	struct mailbox* mb = &mailboxes[pid];
+	int i, n;
+
+	assert(m);
+
+	/* notifications */
+	n = -1;
+	if (src == ANY) {
+		for (i = 0; i < NR_NOTIFY_WORDS; i++) {
+			if (bits[i]) {
+				int b;
+				__asm__ __volatile__("bsfl %1, %0" : "=r"(b) : "rm"(bits[i]));
+				n = i * 32 + b;
+				break;
+			}
+		}
+	}
+	else if (bits[src / 32] & (1 << (src % 32))) {
+		n = src;
+	}
+
+	if (n != -1) {
+		MESSAGE msg;
+		reset_msg(&msg);
+		msg.source = n;
+		msg.type = NOTIFY_MSG;
+		phys_copy(va2la(pid, m), &msg, sizeof(MESSAGE));
+
+		bits[n / 32] &= ~(1 << (n % 32));
+		note_received(pid, n, NOTIFY_MSG);
+		return 1;
+	}
+
+	/* mailbox */
+	for (i = 0; i < mb->count; i++) {
+		MESSAGE* q = &mb->msg[(mb->head + i) % NR_MAILBOX_MSGS];
+		if (src == ANY || q->source == src)
+			break;
+	}
+	if (i == mb->count)
+		return 0;
+
+	phys_copy(va2la(pid, m), &mb->msg[(mb->head + i) % NR_MAILBOX_MSGS],
+		  sizeof(MESSAGE));
+	note_received(pid, ((MESSAGE*)va2la(pid, m))->source,
+		      ((MESSAGE*)va2la(pid, m))->type);
+
+	/* close the gap, keeping the others in arrival order */
+	for (; i > 0; i--)
+		mb->msg[(mb->head + i) % NR_MAILBOX_MSGS] =
+			mb->msg[(mb->head + i - 1) % NR_MAILBOX_MSGS];
+	mb->head = (mb->head + 1) % NR_MAILBOX_MSGS;
+	mb->count--;
+
+	return 1;
+}
+
 /*****************************************************************************
  *                                inform_int
  *****************************************************************************/
@@ -534,6 +1581,8 @@ PUBLIC void inform_int(int task_nr)
 {
 	struct proc* p = proc_table + task_nr;
 
+	TRACE_EVENT(TR_INFORM_INT, task_nr, 0, 0);
+
 	if ((p->p_flags & RECEIVING) && /* dest is waiting for the msg */
 	    ((p->p_recvfrom == INTERRUPT) || (p->p_recvfrom == ANY))) {
 		p->p_msg->source = INTERRUPT;
@@ -542,6 +1591,7 @@ PUBLIC void inform_int(int task_nr)
 		p->has_int_msg = 0;
 		p->p_flags &= ~RECEIVING; /* dest has received the msg */
 		p->p_recvfrom = NO_TASK;
+		note_received(task_nr, INTERRUPT, HARD_INT);
 		assert(p->p_flags == 0);
 		unblock(p);
 
@@ -180,7 +180,7 @@ PUBLIC void init_prot()
 	int i;
 	struct proc* p_proc = proc_table;
 	u16 selector_ldt = INDEX_LDT_FIRST << 3;
-	for (i = 0; i < NR_TASKS+NR_PROCS; i++){
+	for (i = 0; i < NR_TASKS+NR_PROCS+1; i++){ /* + IDLE_PROC */
 		init_descriptor(&gdt[selector_ldt>>3],
 				vir2phys(seg2phys(SELECTOR_KERNEL_DS),
 					proc_table[i].ldts),
@@ -0,0 +1,229 @@
+/*************************************************************************//**
+ *****************************************************************************
+ * @file   serial.c
+ * @brief  Serial console on COM1.
+ *
+ * Output goes into a ring which the UART drains by itself: each THRE
+ * interrupt (IRQ4) refills the 16-byte TX FIFO from the ring, so nobody
+ * waits for the line unless the ring is full. Input is put into a small
+ * ring by the same interrupt and picked up by TASK_TTY, just like the
+ * keyboard's (see key_pressed).
+ *****************************************************************************
+ *****************************************************************************/
+
+#include "type.h"
+#include "stdio.h"
+#include "const.h"
+#include "protect.h"
+#include "string.h"
+#include "fs.h"
+#include "proc.h"
+#include "tty.h"
+#include "console.h"
+#include "global.h"
+#include "proto.h"
+#include "serial.h"
+
+
+PUBLIC int			serial_tty = SERIAL_TTY;
+
+PRIVATE int			serial_present;
+PRIVATE struct serial_ring	tx;
+PRIVATE u8			rx_buf[SERIAL_RX_BYTES];
+PRIVATE u32			rx_head;
+PRIVATE u32			rx_tail;
+
+PRIVATE void	serial_start();
+
+
+/*****************************************************************************
+ *                                init_serial
+ *****************************************************************************/
+/**
+ * <Ring 0> Look for a 16550 at COM1, set it to SERIAL_BAUD 8N1 with the
+ * FIFOs on, and set its interrupt handler.
+ * 
+ *****************************************************************************/
+PUBLIC void init_serial()
+{
+#ifdef SERIAL_CONSOLE
+	int divisor = UART_CLOCK / SERIAL_BAUD;
+
+	/* nothing is there if the scratch register does not hold a byte */
+	out_byte(COM1_BASE + UART_SCR, 0x5A);
+	if (in_byte(COM1_BASE + UART_SCR) != 0x5A)
+		return;
+
+	out_byte(COM1_BASE + UART_IER, 0);
+	out_byte(COM1_BASE + UART_LCR, LCR_DLAB);
+	out_byte(COM1_BASE + UART_DLL, divisor & 0xFF);
+	out_byte(COM1_BASE + UART_DLM, (divisor >> 8) & 0xFF);
+	out_byte(COM1_BASE + UART_LCR, LCR_8N1);
+	out_byte(COM1_BASE + UART_FCR, FCR_ENABLE);
+	out_byte(COM1_BASE + UART_MCR, MCR_DTR_RTS_OUT2);
+
+	/* drop whatever arrived before */
+	while (in_byte(COM1_BASE + UART_LSR) & LSR_DR)
+		in_byte(COM1_BASE + UART_RBR);
+	in_byte(COM1_BASE + UART_IIR);
+
+	tx.head = tx.tail = 0;
+	rx_head = rx_tail = 0;
+	serial_present = 1;
+
+	put_irq_handler(RS232_IRQ, serial_handler);
+	enable_irq(RS232_IRQ);
+	out_byte(COM1_BASE + UART_IER, IER_RDA);
+#endif
+}
+
+
+/*****************************************************************************
+ *                                serial_start
+ *****************************************************************************/
+/**
+ * <Ring 0~1> Move bytes from the ring to the TX FIFO if it is empty, and
+ * ask for a THRE interrupt if any are still left in the ring.
+ *
+ * @attention Interrupts must be off.
+ *****************************************************************************/
+PRIVATE void serial_start()
+{
+	int n;
+
+	if (in_byte(COM1_BASE + UART_LSR) & LSR_THRE) {
+		for (n = 0; n < UART_FIFO_SIZE && tx.tail != tx.head; n++) {
+			out_byte(COM1_BASE + UART_THR,
+				 tx.buf[tx.tail & (SERIAL_TX_BYTES - 1)]);
+			tx.tail++;
+		}
+	}
+
+	out_byte(COM1_BASE + UART_IER,
+		 tx.tail != tx.head ? IER_RDA | IER_THRE : IER_RDA);
+}
+
+
+/*****************************************************************************
+ *                                serial_handler
+ *****************************************************************************/
+/**
+ * <Ring 0> Handles the interrupts generated by COM1: refill the TX FIFO
+ * and take the received bytes. Bytes that do not fit in the RX ring are
+ * dropped, as keyboard_handler() does.
+ * 
+ * @param irq The IRQ nr, unused here.
+ *****************************************************************************/
+PUBLIC void serial_handler(int irq)
+{
+	in_byte(COM1_BASE + UART_IIR);	/* acknowledge */
+
+	while (in_byte(COM1_BASE + UART_LSR) & LSR_DR) {
+		u8 ch = in_byte(COM1_BASE + UART_RBR);
+		if (rx_head - rx_tail < SERIAL_RX_BYTES) {
+			rx_buf[rx_head & (SERIAL_RX_BYTES - 1)] = ch;
+			rx_head++;
+		}
+		key_pressed = 1;
+	}
+
+	serial_start();
+}
+
+
+/*****************************************************************************
+ *                                serial_putc
+ *****************************************************************************/
+/**
+ * <Ring 0~1> Queue a char, as "\r\n" if it is '\n'. If the ring is full,
+ * wait for the UART to make room: logs are never dropped.
+ * 
+ * @param ch  The char.
+ *****************************************************************************/
+PUBLIC void serial_putc(char ch)
+{
+	if (!serial_present)
+		return;
+
+	if (ch == '\n')
+		serial_putc('\r');
+
+	disable_int();
+	while (tx.head - tx.tail == SERIAL_TX_BYTES)
+		serial_start();
+	tx.buf[tx.head & (SERIAL_TX_BYTES - 1)] = ch;
+	tx.head++;
+	serial_start();
+	enable_int();
+}
+
+
+/*****************************************************************************
+ *                                serial_write
+ *****************************************************************************/
+/**
+ * <Ring 0~1> Queue a buffer.
+ * 
+ * @param buf  The chars.
+ * @param len  How many.
+ *****************************************************************************/
+PUBLIC void serial_write(const char* buf, int len)
+{
+	while (len-- > 0)
+		serial_putc(*buf++);
+}
+
+
+/*****************************************************************************
+ *                                serial_getc
+ *****************************************************************************/
+/**
+ * <Ring 1> Take a char received on COM1.
+ * 
+ * @return The char, or -1 if there is none.
+ *****************************************************************************/
+PUBLIC int serial_getc()
+{
+	int ch;
+
+	if (rx_tail == rx_head)
+		return -1;
+
+	ch = rx_buf[rx_tail & (SERIAL_RX_BYTES - 1)];
+	rx_tail++;
+	return ch;
+}
+
+
+/*****************************************************************************
+ *                                serial_poll_puts
+ *****************************************************************************/
+/**
+ * <Ring 0> Print a string without interrupts, for panic(): what is in the
+ * ring goes first, then the string, both by polling the UART.
+ * 
+ * @param s  The string.
+ *****************************************************************************/
+PUBLIC void serial_poll_puts(const char* s)
+{
+	if (!serial_present)
+		return;
+
+	out_byte(COM1_BASE + UART_IER, 0);
+
+	while (tx.tail != tx.head) {
+		while (!(in_byte(COM1_BASE + UART_LSR) & LSR_THRE)) {}
+		out_byte(COM1_BASE + UART_THR,
+			 tx.buf[tx.tail & (SERIAL_TX_BYTES - 1)]);
+		tx.tail++;
+	}
+
+	for (; *s; s++) {
+		if (*s == '\n') {
+			while (!(in_byte(COM1_BASE + UART_LSR) & LSR_THRE)) {}
+			out_byte(COM1_BASE + UART_THR, '\r');
+		}
+		while (!(in_byte(COM1_BASE + UART_LSR) & LSR_THRE)) {}
+		out_byte(COM1_BASE + UART_THR, *s);
+	}
+}
@@ -19,6 +19,10 @@
 #include "global.h"
 #include "keyboard.h"
 #include "proto.h"
+#include "grant.h"
+#include "timer.h"
+#include "sched.h"
+#include "stats.h"
 
 
 /*****************************************************************************
@@ -45,6 +49,47 @@ PUBLIC void task_sys()
 			msg.PID = src;
 			send_recv(SEND, src, &msg);
 			break;
+		case GRANT_CREATE:
+			msg.RETVAL = grant_alloc(src, msg.PROC_NR,
+						 va2la(src, msg.BUF),
+						 msg.CNT, msg.FLAGS);
+			msg.type = SYSCALL_RET;
+			send_recv(SEND, src, &msg);
+			break;
+		case GRANT_REVOKE:
+			msg.RETVAL = grant_free(src, msg.GRANT);
+			msg.type = SYSCALL_RET;
+			send_recv(SEND, src, &msg);
+			break;
+		case GET_PROC_STATS:
+			if (msg.PROC_NR >= 0 && msg.PROC_NR <= IDLE_PROC) {
+				phys_copy(va2la(src, msg.BUF),
+					  va2la(TASK_SYS,
+						&proc_stats[msg.PROC_NR]),
+					  sizeof(struct proc_stats));
+				msg.RETVAL = 0;
+			}
+			else {
+				msg.RETVAL = -1;
+			}
+			msg.type = SYSCALL_RET;
+			send_recv(SEND, src, &msg);
+			break;
+		case SLEEP:
+			/* no reply until the timer fires */
+			set_timer(src, msg.CNT);
+			break;
+		case HARD_INT:
+			/**
+			 * waked up by clock_handler -- some timers fired
+			 * @see run_wheel()
+			 */
+			while ((src = next_expired()) != -1) {
+				reset_msg(&msg);
+				msg.type = SYSCALL_RET;
+				send_recv(SEND, src, &msg);
+			}
+			break;
 		default:
 			panic("unknown msg type");
 			break;
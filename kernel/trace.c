@@ -0,0 +1,85 @@
+/*************************************************************************//**
+ *****************************************************************************
+ * @file   trace.c
+ * @brief  Kernel trace ring.
+ *****************************************************************************
+ *****************************************************************************/
+
+#include "type.h"
+#include "stdio.h"
+#include "const.h"
+#include "protect.h"
+#include "string.h"
+#include "fs.h"
+#include "proc.h"
+#include "tty.h"
+#include "console.h"
+#include "global.h"
+#include "proto.h"
+#include "trace.h"
+#include "tsc.h"
+
+
+PUBLIC struct trace_ring trace_ring = {0, 1};
+
+
+/*****************************************************************************
+ *                                trace_emit
+ *****************************************************************************/
+/**
+ * <Ring 0~1> Append a record to the trace ring, overwriting the oldest one
+ * if the ring is full.
+ * 
+ * @param type  TR_XXX.
+ * @param a     See trace.h.
+ * @param b     See trace.h.
+ * @param c     See trace.h.
+ *****************************************************************************/
+PUBLIC void trace_emit(int type, int a, int b, int c)
+{
+	u32 i = 1;
+	struct trace_rec* r;
+
+	if (!trace_ring.on)
+		return;
+
+	__asm__ __volatile__("lock; xaddl %0, %1"
+			     : "+r"(i), "+m"(trace_ring.head) : : "memory");
+
+	r = &trace_ring.rec[i & (NR_TRACE_RECS - 1)];
+	r->seq = 0;
+	rdtsc(r->tsc_lo, r->tsc_hi);
+	r->ticks = ticks;
+	r->type = type;
+	r->a = a;
+	r->b = b;
+	r->c = c;
+	__asm__ __volatile__("" : : : "memory");
+	r->seq = i + 1;
+}
+
+/*****************************************************************************
+ *                                trace_irq_enter
+ *****************************************************************************/
+/**
+ * <Ring 0> Called by hwint_master/hwint_slave right before the handler.
+ * 
+ * @param irq  The IRQ nr.
+ *****************************************************************************/
+PUBLIC void trace_irq_enter(int irq)
+{
+	TRACE_EVENT(TR_IRQ_ENTER, irq, 0, 0);
+}
+
+/*****************************************************************************
+ *                                trace_irq_exit
+ *****************************************************************************/
+/**
+ * <Ring 0> Called by hwint_master/hwint_slave right after the handler.
+ * 
+ * @param irq  The IRQ nr.
+ *****************************************************************************/
+PUBLIC void trace_irq_exit(int irq)
+{
+	TRACE_EVENT(TR_IRQ_EXIT, irq, 0, 0);
+}
@@ -7,6 +7,7 @@
  *   - DEV_OPEN
  *   - DEV_READ
  *   - DEV_WRITE
+ *   - SERIAL_SELECT (which TTY is mirrored on COM1, see serial.h)
  *
  * Besides, it accepts the other two types of MESSAGE from clock_handler() and
  * a PROC (who is not FS):
@@ -48,6 +49,10 @@
 #include "global.h"
 #include "keyboard.h"
 #include "proto.h"
+#include "ipc.h"
+#include "grant.h"
+#include "serial.h"
+#include "frame.h"
 
 
 #define TTY_FIRST	(tty_table)
@@ -57,6 +62,9 @@
 PRIVATE void	init_tty	(TTY* tty);
 PRIVATE void	tty_dev_read	(TTY* tty);
 PRIVATE void	tty_dev_write	(TTY* tty);
+PRIVATE void	tty_putc	(TTY* tty, char ch);
+PRIVATE void	tty_puts	(TTY* tty, int src, const char* buf, int len);
+PRIVATE void	tty_do_frame	(TTY* tty, int src, int request);
 PRIVATE void	tty_do_read	(TTY* tty, MESSAGE* msg);
 PRIVATE void	tty_do_write	(TTY* tty, MESSAGE* msg);
 PRIVATE void	put_key		(TTY* tty, u32 key);
@@ -102,11 +110,22 @@ PUBLIC void task_tty()
 			send_recv(SEND, src, &msg);
 			break;
 		case DEV_READ:
+		case DEV_READ_S:
 			tty_do_read(ptty, &msg);
 			break;
 		case DEV_WRITE:
+		case DEV_WRITE_S:
 			tty_do_write(ptty, &msg);
 			break;
+		case SERIAL_SELECT:
+			if (msg.DEVICE >= 0 && msg.DEVICE < NR_CONSOLES)
+				serial_tty = msg.DEVICE;
+			else
+				serial_tty = SERIAL_NONE;
+			reset_msg(&msg);
+			msg.type = SYSCALL_RET;
+			send_recv(SEND, src, &msg);
+			break;
 		case HARD_INT:
 			/**
 			 * waked up by clock_handler -- a key was just pressed
@@ -228,7 +247,7 @@ PRIVATE void put_key(TTY* tty, u32 key)
  *****************************************************************************/
 /**
  * Get chars from the keyboard buffer if the TTY::console is the `current'
- * console.
+ * console, and from COM1 if the TTY is the one mirrored there.
  *
  * @see keyboard_read()
  * 
@@ -236,8 +255,21 @@ PRIVATE void put_key(TTY* tty, u32 key)
  *****************************************************************************/
 PRIVATE void tty_dev_read(TTY* tty)
 {
+	int ch;
+
 	if (is_current_console(tty->console))
 		keyboard_read(tty);
+
+	if (tty - tty_table != serial_tty)
+		return;
+
+	while ((ch = serial_getc()) != -1) {
+		if (ch == '\r')
+			ch = '\n';
+		else if (ch == 0x7F)	/* DEL, what most terminals send */
+			ch = '\b';
+		put_key(tty, ch);
+	}
 }
 
 
@@ -260,7 +292,7 @@ PRIVATE void tty_dev_write(TTY* tty)
 
 		if (tty->tty_left_cnt) {
 			if (ch >= ' ' && ch <= '~') { /* printable */
-				out_char(tty->console, ch);
+				tty_putc(tty, ch);
 				void * p = tty->tty_req_buf +
 					   tty->tty_trans_cnt;
 				phys_copy(p, (void *)va2la(TASK_TTY, &ch), 1);
@@ -268,18 +300,20 @@ PRIVATE void tty_dev_write(TTY* tty)
 				tty->tty_left_cnt--;
 			}
 			else if (ch == '\b' && tty->tty_trans_cnt) {
-				out_char(tty->console, ch);
+				tty_putc(tty, ch);
 				tty->tty_trans_cnt--;
 				tty->tty_left_cnt++;
 			}
 
 			if (ch == '\n' || tty->tty_left_cnt == 0) {
-				out_char(tty->console, '\n');
+				tty_putc(tty, '\n');
 				MESSAGE msg;
 				msg.type = RESUME_PROC;
 				msg.PROC_NR = tty->tty_procnr;
 				msg.CNT = tty->tty_trans_cnt;
-				send_recv(SEND, tty->tty_caller, &msg);
+				/* don't wait for FS to pick it up */
+				if (send_recv(SENDA, tty->tty_caller, &msg) != 0)
+					send_recv(SEND, tty->tty_caller, &msg);
 				tty->tty_left_cnt = 0;
 			}
 		}
@@ -287,6 +321,56 @@ PRIVATE void tty_dev_write(TTY* tty)
 }
 
 
+/*****************************************************************************
+ *                                tty_putc
+ *****************************************************************************/
+/**
+ * Print a char in the console of a TTY, and on COM1 if the TTY is the one
+ * mirrored there.
+ * 
+ * @param tty  Ptr to TTY.
+ * @param ch   The char.
+ *****************************************************************************/
+PRIVATE void tty_putc(TTY* tty, char ch)
+{
+	tty_puts(tty, NO_TASK, &ch, 1);
+}
+
+
+/*****************************************************************************
+ *                                tty_puts
+ *****************************************************************************/
+/**
+ * Print a buffer in the console of a TTY with one console_write(), or in
+ * the frame being drawn if it is the writer's, and on COM1 if the TTY is
+ * the one mirrored there.
+ * 
+ * @param tty  Ptr to TTY.
+ * @param src  Who writes, NO_TASK if no proc does.
+ * @param buf  The chars.
+ * @param len  How many.
+ *****************************************************************************/
+PRIVATE void tty_puts(TTY* tty, int src, const char* buf, int len)
+{
+	int i;
+
+	if (in_frame(tty->console, src))
+		frame_write(tty->console, buf, len);
+	else
+		console_write(tty->console, buf, len);
+
+	if (tty - tty_table != serial_tty)
+		return;
+
+	for (i = 0; i < len; i++) {
+		if (buf[i] == '\b')
+			serial_write("\b \b", 3); /* rub it out on the terminal */
+		else
+			serial_putc(buf[i]);
+	}
+}
+
+
 /*****************************************************************************
  *                                tty_do_read
  *****************************************************************************/
@@ -297,16 +381,32 @@ PRIVATE void tty_dev_write(TTY* tty)
  * TTY struct, telling FS to suspend the proc who wants to read. The real
  * transfer (tty buffer -> proc buffer) is not done here.
  * 
+ * For DEV_READ_S the whole grant is checked here, once, so the chars can
+ * later be put into it without checking again.
+ * 
  * @param tty  From which TTY the caller proc wants to read.
  * @param msg  The MESSAGE just received.
  *****************************************************************************/
 PRIVATE void tty_do_read(TTY* tty, MESSAGE* msg)
 {
+	void * la;
+	if (msg->type == DEV_READ_S) {
+		la = grant_la(TASK_TTY, msg->GRANT, 0, msg->CNT, GRANT_WRITE);
+		if (!la) {
+			msg->type = SYSCALL_RET;
+			msg->CNT = 0;
+			send_recv(SEND, msg->source, msg);
+			return;
+		}
+	}
+	else {
+		la = va2la(msg->PROC_NR, msg->BUF);
+	}
+
 	/* tell the tty: */
 	tty->tty_caller   = msg->source;  /* who called, usually FS */
 	tty->tty_procnr   = msg->PROC_NR; /* who wants the chars */
-	tty->tty_req_buf  = va2la(tty->tty_procnr,
-				  msg->BUF);/* where the chars should be put */
+	tty->tty_req_buf  = la;		  /* where the chars should be put */
 	tty->tty_left_cnt = msg->CNT; /* how many chars are requested */
 	tty->tty_trans_cnt= 0; /* how many chars have been transferred */
 
@@ -322,23 +422,43 @@ PRIVATE void tty_do_read(TTY* tty, MESSAGE* msg)
 /**
  * Invoked when task TTY receives DEV_WRITE message.
  * 
+ * For DEV_WRITE_S the chars are taken right out of the grant, without
+ * going through a buffer on the stack.
+ * 
+ * A write of {MAG_CH_FRAME, TIOCTL_XXX} is a frame request, see frame.h.
+ * 
  * @param tty  To which TTY the calller proc is bound.
  * @param msg  The MESSAGE.
  *****************************************************************************/
 PRIVATE void tty_do_write(TTY* tty, MESSAGE* msg)
 {
 	char buf[TTY_OUT_BUF_LEN];
-	char * p = (char*)va2la(msg->PROC_NR, msg->BUF);
+	char * p;
 	int i = msg->CNT;
-	int j;
-
-	while (i) {
-		int bytes = min(TTY_OUT_BUF_LEN, i);
-		phys_copy(va2la(TASK_TTY, buf), (void*)p, bytes);
-		for (j = 0; j < bytes; j++)
-			out_char(tty->console, buf[j]);
-		i -= bytes;
-		p += bytes;
+
+	if (msg->type == DEV_WRITE_S) {
+		p = (char*)grant_la(TASK_TTY, msg->GRANT, 0, i, GRANT_READ);
+		if (!p)
+			msg->CNT = i = 0;
+	}
+	else {
+		p = (char*)va2la(msg->PROC_NR, msg->BUF);
+	}
+
+	if (i == 2 && p[0] == MAG_CH_FRAME) {
+		tty_do_frame(tty, msg->PROC_NR, p[1]);
+	}
+	else if (msg->type == DEV_WRITE_S) {
+		tty_puts(tty, msg->PROC_NR, p, i);
+	}
+	else {
+		while (i) {
+			int bytes = min(TTY_OUT_BUF_LEN, i);
+			phys_copy(va2la(TASK_TTY, buf), (void*)p, bytes);
+			tty_puts(tty, msg->PROC_NR, buf, bytes);
+			i -= bytes;
+			p += bytes;
+		}
 	}
 
 	msg->type = SYSCALL_RET;
@@ -346,6 +466,25 @@ PRIVATE void tty_do_write(TTY* tty, MESSAGE* msg)
 }
 
 
+/*****************************************************************************
+ *                                tty_do_frame
+ *****************************************************************************/
+/**
+ * Handle a frame request written to a TTY.
+ * 
+ * @param tty      The TTY.
+ * @param src      Who wrote it.
+ * @param request  TIOCTL_XXX, see frame.h.
+ *****************************************************************************/
+PRIVATE void tty_do_frame(TTY* tty, int src, int request)
+{
+	if (request == TIOCTL_FRAME_BEGIN || request == TIOCTL_FRAME_CLEAR)
+		frame_begin(tty->console, src);
+	if (request == TIOCTL_FRAME_END || request == TIOCTL_FRAME_CLEAR)
+		frame_end(tty->console);
+}
+
+
 /*****************************************************************************
  *                                sys_printx
  *****************************************************************************/
@@ -373,7 +512,6 @@ PRIVATE void tty_do_write(TTY* tty, MESSAGE* msg)
 PUBLIC int sys_printx(int _unused1, int _unused2, char* s, struct proc* p_proc)
 {
 	const char * p;
-	char ch;
 
 	char reenter_err[] = "? k_reenter is incorrect for unknown reason";
 	reenter_err[0] = MAG_CH_PANIC;
@@ -407,6 +545,9 @@ PUBLIC int sys_printx(int _unused1, int _unused2, char* s, struct proc* p_proc)
 	if ((*p == MAG_CH_PANIC) ||
 	    (*p == MAG_CH_ASSERT && p_proc_ready < &proc_table[NR_TASKS])) {
 		disable_int();
+		serial_poll_puts(p + 1);
+		serial_poll_puts("\n");
+
 		char * v = (char*)V_MEM_BASE;
 		const char * q = p + 1; /* +1: skip the magic char */
 
@@ -426,14 +567,20 @@ PUBLIC int sys_printx(int _unused1, int _unused2, char* s, struct proc* p_proc)
 		__asm__ __volatile__("hlt");
 	}
 
-	while ((ch = *p++) != 0) {
-		if (ch == MAG_CH_PANIC || ch == MAG_CH_ASSERT)
+	while (*p) {
+		if (*p == MAG_CH_PANIC || *p == MAG_CH_ASSERT) {
+			p++;
 			continue; /* skip the magic char */
+		}
+
+		/* print everything up to the next magic char at once */
+		const char * q = p;
+		while (*q && *q != MAG_CH_PANIC && *q != MAG_CH_ASSERT)
+			q++;
 
-		/* TTY * ptty; */
-		/* for (ptty = TTY_FIRST; ptty < TTY_END; ptty++) */
-		/* 	out_char(ptty->console, ch); /\* output chars to all TTYs *\/ */
-		out_char(TTY_FIRST->console, ch);
+		console_write(TTY_FIRST->console, p, q - p);
+		serial_write(p, q - p); /* kernel log, whatever serial_tty is */
+		p = q;
 	}
 
 	//__asm__ __volatile__("nop;jmp 1f;ud2;1: nop");
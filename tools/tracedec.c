@@ -0,0 +1,221 @@
+/*************************************************************************//**
+ *****************************************************************************
+ * @file   tracedec.c
+ * @brief  Offline decoder of the kernel trace ring.
+ *
+ * Runs on the host, not in Orange'S. Feed it a capture of the `trace'
+ * shell command (everything between `TRACE BEGIN' and `TRACE END' is
+ * used, the rest is ignored):
+ *
+ *	cc -o tracedec tools/tracedec.c
+ *	./tracedec < capture.txt
+ *
+ * It prints log2 histograms, in TSC cycles, of:
+ *   - IRQ handler time         (TR_IRQ_ENTER -> TR_IRQ_EXIT, same irq)
+ *   - HD command latency       (TR_HD_CMD -> TR_HD_DONE)
+ *   - IPC delivery latency     (TR_SEND a->b -> TR_RECV by b from a)
+ *   - wake-up latency          (TR_RECV by p -> TR_SCHED to p)
+ *****************************************************************************
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+
+/* keep them in sync with include/sys/trace.h */
+#define	TR_SCHED		1
+#define	TR_SEND			2
+#define	TR_RECV			3
+#define	TR_INFORM_INT		4
+#define	TR_IRQ_ENTER		5
+#define	TR_IRQ_EXIT		6
+#define	TR_HD_CMD		7
+#define	TR_HD_DONE		8
+
+#define	NR_IRQ			16
+#define	MAX_PROCS		64	/* more than NR_TASKS + NR_PROCS + 1 */
+#define	INTERRUPT		-10	/* as in const.h */
+#define	NR_BUCKETS		40
+
+struct hist {
+	const char *		name;
+	unsigned long		count;
+	unsigned long long	min;
+	unsigned long long	max;
+	unsigned long long	sum;
+	unsigned long		bucket[NR_BUCKETS];	/* [2^i, 2^(i+1)) */
+};
+
+static struct hist h_irq  = {"IRQ handler"};
+static struct hist h_hd   = {"HD command"};
+static struct hist h_ipc  = {"IPC delivery"};
+static struct hist h_wake = {"wake-up"};
+
+/* start times, 0 if none pending */
+static unsigned long long irq_enter[NR_IRQ];
+static unsigned long long hd_cmd;
+static unsigned long long sent[MAX_PROCS][MAX_PROCS];
+static unsigned long long received[MAX_PROCS];
+
+
+/*****************************************************************************
+ *                                add
+ *****************************************************************************/
+/**
+ * Put a latency into a histogram.
+ *
+ * @param h  The histogram.
+ * @param v  The latency, in cycles.
+ *****************************************************************************/
+static void add(struct hist* h, unsigned long long v)
+{
+	int i = 0;
+
+	while (i < NR_BUCKETS - 1 && (v >> (i + 1)))
+		i++;
+	h->bucket[i]++;
+
+	if (h->count == 0 || v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+	h->sum += v;
+	h->count++;
+}
+
+/*****************************************************************************
+ *                                print_hist
+ *****************************************************************************/
+/**
+ * Print a histogram with a bar for every non-empty bucket.
+ *
+ * @param h  The histogram.
+ *****************************************************************************/
+static void print_hist(struct hist* h)
+{
+	unsigned long most = 0;
+	int i, j;
+
+	printf("%s: %lu samples", h->name, h->count);
+	if (!h->count) {
+		printf("\n\n");
+		return;
+	}
+	printf(", min %llu, avg %llu, max %llu cycles\n",
+	       h->min, h->sum / h->count, h->max);
+
+	for (i = 0; i < NR_BUCKETS; i++)
+		if (h->bucket[i] > most)
+			most = h->bucket[i];
+
+	for (i = 0; i < NR_BUCKETS; i++) {
+		if (!h->bucket[i])
+			continue;
+		printf("  %12llu+ %8lu ", 1ULL << i, h->bucket[i]);
+		for (j = 0; j < (int)(h->bucket[i] * 50 / most); j++)
+			putchar('#');
+		putchar('\n');
+	}
+	putchar('\n');
+}
+
+/*****************************************************************************
+ *                                valid
+ *****************************************************************************/
+static int valid(int pid)
+{
+	return pid >= 0 && pid < MAX_PROCS;
+}
+
+/*****************************************************************************
+ *                                decode
+ *****************************************************************************/
+/**
+ * Match one record against the pending starts.
+ *****************************************************************************/
+static void decode(unsigned long long tsc, int type, int a, int b)
+{
+	switch (type) {
+	case TR_IRQ_ENTER:
+		if (a >= 0 && a < NR_IRQ)
+			irq_enter[a] = tsc;
+		break;
+	case TR_IRQ_EXIT:
+		if (a >= 0 && a < NR_IRQ && irq_enter[a]) {
+			add(&h_irq, tsc - irq_enter[a]);
+			irq_enter[a] = 0;
+		}
+		break;
+	case TR_HD_CMD:
+		hd_cmd = tsc;
+		break;
+	case TR_HD_DONE:
+		if (hd_cmd) {
+			add(&h_hd, tsc - hd_cmd);
+			hd_cmd = 0;
+		}
+		break;
+	case TR_SEND:
+		if (valid(a) && valid(b))
+			sent[a][b] = tsc;
+		break;
+	case TR_RECV:
+		/* a: receiver, b: sender */
+		if (valid(a) && valid(b) && sent[b][a]) {
+			add(&h_ipc, tsc - sent[b][a]);
+			sent[b][a] = 0;
+		}
+		if (valid(a))
+			received[a] = tsc;
+		break;
+	case TR_SCHED:
+		/* b: the proc switched to */
+		if (valid(b) && received[b]) {
+			add(&h_wake, tsc - received[b]);
+			received[b] = 0;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+/*****************************************************************************
+ *                                main
+ *****************************************************************************/
+int main()
+{
+	char line[256];
+	int in_dump = 0;
+	unsigned long nr_recs = 0;
+
+	while (fgets(line, sizeof(line), stdin)) {
+		unsigned int seq, hi, lo;
+		int ticks, type, a, b, c;
+
+		if (!strncmp(line, "TRACE BEGIN", 11)) {
+			in_dump = 1;
+			continue;
+		}
+		if (!strncmp(line, "TRACE END", 9)) {
+			in_dump = 0;
+			continue;
+		}
+		if (!in_dump)
+			continue;
+
+		if (sscanf(line, "%u %x %x %d %d %d %d %d",
+			   &seq, &hi, &lo, &ticks, &type, &a, &b, &c) != 8)
+			continue;
+
+		decode((unsigned long long)hi << 32 | lo, type, a, b);
+		nr_recs++;
+	}
+
+	printf("%lu records\n\n", nr_recs);
+	print_hist(&h_irq);
+	print_hist(&h_hd);
+	print_hist(&h_ipc);
+	print_hist(&h_wake);
+
+	return 0;
+}